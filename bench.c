@@ -0,0 +1,534 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ftree.h"
+#include "mux.h"
+#include "zerocopy.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#define DEFAULT_REPS 5
+#define DEFAULT_MAXSIZE (1L << 30)
+#define MAX_SAMPLES 64
+
+// Per-repetition work is scaled so that each sample covers at least this
+// many bytes (or operations), which keeps timer resolution out of the way.
+#define MIN_BYTES_PER_SAMPLE (8L << 20)
+#define OPS_PER_SAMPLE 200000
+#define TRANSMIT_BYTES (256L << 20)
+
+// Transmit modes
+#define TRANSMIT_COPY 0     // plain writes with the kernel's defaults
+#define TRANSMIT_TUNED 1    // TCP_NODELAY, sized buffers, MSG_MORE
+#define TRANSMIT_ZEROCOPY 2 // as tuned, with MSG_ZEROCOPY
+
+/*
+ * The result of one benchmark: REPS samples, each one an average over
+ * several iterations of the operation being measured.
+ */
+struct sample_set {
+    int n;
+    double ns[MAX_SAMPLES];     // nanoseconds per operation
+    double cycles[MAX_SAMPLES]; // TSC cycles per operation
+};
+
+/*
+ * This function returns the current value of the monotonic clock in
+ * nanoseconds.
+ */
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * This function returns the time stamp counter, or 0 on architectures
+ * that do not have one (cycles/byte is then reported as n/a).
+ */
+static unsigned long long now_cycles(void) {
+#ifdef HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/*
+ * This function takes an array of n doubles as input and stores their
+ * mean and standard deviation in mean and stddev.
+ */
+static void stats(const double *v, int n, double *mean, double *stddev) {
+    double sum = 0, sq = 0;
+    for (int i = 0; i < n; i++) {
+        sum += v[i];
+    }
+    *mean = sum / n;
+    for (int i = 0; i < n; i++) {
+        sq += (v[i] - *mean) * (v[i] - *mean);
+    }
+    *stddev = n > 1 ? sqrt(sq / (n - 1)) : 0;
+}
+
+/*
+ * This function prints one line of results. bytes is the number of input
+ * bytes per operation, or 0 when the operation is not size-dependent.
+ */
+static void report(const char *name, const char *variant, long bytes,
+                   struct sample_set *s) {
+    double ns_mean, ns_sd, cyc_mean, cyc_sd;
+    stats(s->ns, s->n, &ns_mean, &ns_sd);
+    stats(s->cycles, s->n, &cyc_mean, &cyc_sd);
+
+    char size_str[32] = "-";
+    if (bytes >= (1L << 30)) {
+        snprintf(size_str, sizeof(size_str), "%ldG", bytes >> 30);
+    } else if (bytes >= (1L << 20)) {
+        snprintf(size_str, sizeof(size_str), "%ldM", bytes >> 20);
+    } else if (bytes >= (1L << 10)) {
+        snprintf(size_str, sizeof(size_str), "%ldK", bytes >> 10);
+    } else if (bytes > 0) {
+        snprintf(size_str, sizeof(size_str), "%ldB", bytes);
+    }
+
+    printf("%-14s %-6s %6s %14.1f %7.1f%%", name, variant, size_str, ns_mean,
+           ns_mean > 0 ? 100.0 * ns_sd / ns_mean : 0.0);
+    if (bytes > 0 && cyc_mean > 0) {
+        printf(" %10.2f %10.1f\n", cyc_mean / bytes,
+               bytes / ns_mean * 1e9 / (1 << 20));
+    } else if (bytes > 0) {
+        printf(" %10s %10.1f\n", "n/a", bytes / ns_mean * 1e9 / (1 << 20));
+    } else {
+        printf(" %10s %10s\n", "-", "-");
+    }
+}
+
+/*
+ * This function takes a directory dir and a size as inputs, and creates a
+ * file of that size filled with random bytes. It returns the malloc'ed
+ * path of the file.
+ */
+static char *make_input_file(const char *dir, long size) {
+    char name[64];
+    snprintf(name, sizeof(name), "rcopy_bench.%d.%ld", getpid(), size);
+    char *path = generate_path(dir, name);
+
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        perror("bench: fopen");
+        exit(1);
+    }
+    char buffer[65536];
+    unsigned int seed = (unsigned int)size;
+    for (long left = size; left > 0; ) {
+        int n = left < (long)sizeof(buffer) ? (int)left : (int)sizeof(buffer);
+        for (int i = 0; i < n; i++) {
+            buffer[i] = rand_r(&seed);
+        }
+        if (fwrite(buffer, 1, n, f) != n) {
+            perror("bench: fwrite");
+            exit(1);
+        }
+        left -= n;
+    }
+    // Flush to disk so that POSIX_FADV_DONTNEED can really evict the pages.
+    if (fflush(f) == EOF || fsync(fileno(f)) == -1) {
+        perror("bench: fsync");
+        exit(1);
+    }
+    if (fclose(f) == EOF) {
+        perror("bench: fclose");
+        exit(1);
+    }
+    return path;
+}
+
+/*
+ * This function takes a path as input and asks the kernel to drop its
+ * pages from the page cache, so that the next read comes from the device.
+ */
+static void drop_cache(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("bench: open");
+        exit(1);
+    }
+    if (posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) != 0) {
+        fprintf(stderr, "bench: posix_fadvise failed\n");
+    }
+    close(fd);
+}
+
+/*
+ * This function benchmarks hash() over a file of the given size. When cold
+ * is set, the file is evicted from the page cache before every iteration
+ * (outside of the timed region).
+ */
+static void bench_hash(const char *dir, long size, int reps, int cold) {
+    char *path = make_input_file(dir, size);
+    int iters = cold ? 1 : (int)(MIN_BYTES_PER_SAMPLE / size);
+    if (iters < 1) {
+        iters = 1;
+    }
+
+    struct sample_set s = {0};
+    char blank[BLOCKSIZE];
+    // One untimed pass to warm up the cache and the code path.
+    if (!cold) {
+        FILE *f = fopen(path, "rb");
+        hash(blank, f);
+        fclose(f);
+    }
+    for (int r = 0; r < reps; r++) {
+        double ns = 0;
+        unsigned long long cycles = 0;
+        for (int it = 0; it < iters; it++) {
+            if (cold) {
+                drop_cache(path);
+            }
+            double t0 = now_ns();
+            unsigned long long c0 = now_cycles();
+            FILE *f = fopen(path, "rb");
+            if (f == NULL) {
+                perror("bench: fopen");
+                exit(1);
+            }
+            hash(blank, f);
+            fclose(f);
+            cycles += now_cycles() - c0;
+            ns += now_ns() - t0;
+        }
+        s.ns[s.n] = ns / iters;
+        s.cycles[s.n] = (double)cycles / iters;
+        s.n++;
+    }
+    report("hash", cold ? "cold" : "warm", size, &s);
+
+    unlink(path);
+    free(path);
+}
+
+/*
+ * This function benchmarks check_hash() on two identical hashes, which is
+ * the common (and slowest) case because every byte is compared.
+ */
+static void bench_check_hash(int reps) {
+    char h1[BLOCKSIZE], h2[BLOCKSIZE];
+    for (int i = 0; i < BLOCKSIZE; i++) {
+        h1[i] = h2[i] = (char)(i * 31 + 7);
+    }
+
+    struct sample_set s = {0};
+    volatile int sink = 0;
+    for (int r = 0; r < reps; r++) {
+        double t0 = now_ns();
+        unsigned long long c0 = now_cycles();
+        for (int it = 0; it < OPS_PER_SAMPLE; it++) {
+            sink += check_hash(h1, h2);
+        }
+        s.cycles[s.n] = (double)(now_cycles() - c0) / OPS_PER_SAMPLE;
+        s.ns[s.n] = (now_ns() - t0) / OPS_PER_SAMPLE;
+        s.n++;
+    }
+    report("check_hash", "-", 0, &s);
+}
+
+/*
+ * This function benchmarks generate_path() with a parent path and a child
+ * name that together take up total_len bytes.
+ */
+static void bench_generate_path(int reps, int total_len) {
+    char parent[MAXPATH], name[MAXPATH];
+    int parent_len = total_len * 3 / 4;
+    int name_len = total_len - parent_len - 1;
+    memset(parent, 'p', parent_len);
+    parent[parent_len] = '\0';
+    memset(name, 'n', name_len);
+    name[name_len] = '\0';
+
+    struct sample_set s = {0};
+    for (int r = 0; r < reps; r++) {
+        double t0 = now_ns();
+        unsigned long long c0 = now_cycles();
+        for (int it = 0; it < OPS_PER_SAMPLE; it++) {
+            free(generate_path(parent, name));
+        }
+        s.cycles[s.n] = (double)(now_cycles() - c0) / OPS_PER_SAMPLE;
+        s.ns[s.n] = (now_ns() - t0) / OPS_PER_SAMPLE;
+        s.n++;
+    }
+    report("generate_path", "-", total_len, &s);
+}
+
+/*
+ * This function benchmarks write_request(), i.e. encoding one request
+ * and writing it as a frame onto a file descriptor. /dev/null is used as
+ * the sink so that the result is the encoding and system call cost only,
+ * with no network involved.
+ */
+static void bench_write_request(int reps) {
+    int fd = open("/dev/null", O_WRONLY);
+    if (fd == -1) {
+        perror("bench: open");
+        exit(1);
+    }
+    struct request req;
+    memset(&req, 0, sizeof(req));
+    req.type = htonl(REGFILE);
+    strcpy(req.path, "workspace1/final_test/src/final_test/Test.java");
+    req.mode = 0644;
+    req.size = htobe64(4096);
+
+    struct sample_set s = {0};
+    int ops = OPS_PER_SAMPLE / 10;
+    for (int r = 0; r < reps; r++) {
+        double t0 = now_ns();
+        unsigned long long c0 = now_cycles();
+        for (int it = 0; it < ops; it++) {
+            if (write_request(fd, METADATA_STREAM, &req) == -1) {
+                perror("bench: write");
+                exit(1);
+            }
+        }
+        s.cycles[s.n] = (double)(now_cycles() - c0) / ops;
+        s.ns[s.n] = (now_ns() - t0) / ops;
+        s.n++;
+    }
+    report("write_request", "-", 0, &s);
+    close(fd);
+}
+
+/*
+ * This function takes a socket fd as input, and reads and discards
+ * everything that arrives on it, sending back one byte for every
+ * TRANSMIT_BYTES. It runs in a child process and exits at end of file.
+ */
+static void drain(int fd) {
+    static char buffer[1 << 20];
+    long received = 0;
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        received += n;
+        if (received >= TRANSMIT_BYTES) {
+            received -= TRANSMIT_BYTES;
+            if (write(fd, "", 1) != 1) {
+                _exit(1);
+            }
+        }
+    }
+    _exit(n == 0 ? 0 : 1);
+}
+
+/*
+ * This function benchmarks sending file data as frames over a loopback
+ * TCP connection in one of the transmit modes, from the first byte until
+ * the receiver has it all. A child process is the receiver.
+ */
+static void bench_transmit(int reps, int mode) {
+    static const char *names[] = {"copy", "tuned", "zcopy"};
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (mode != TRANSMIT_COPY) {
+        size_socket_buffer(listen_fd, SO_RCVBUF, CONNECTION_WINDOW(DEFAULT_STREAM_WINDOW));
+    }
+    if (listen_fd == -1 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(listen_fd, 1) == -1 || getsockname(listen_fd, (struct sockaddr *)&addr, &addr_len) == -1) {
+        perror("bench: listen");
+        exit(1);
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (mode != TRANSMIT_COPY) {
+        size_socket_buffer(fd, SO_SNDBUF, CONNECTION_WINDOW(DEFAULT_STREAM_WINDOW));
+    }
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("bench: connect");
+        exit(1);
+    }
+    int peer_fd = accept(listen_fd, NULL, NULL);
+    if (peer_fd == -1) {
+        perror("bench: accept");
+        exit(1);
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("bench: fork");
+        exit(1);
+    } else if (pid == 0) {
+        close(fd);
+        drain(peer_fd);
+    }
+    close(peer_fd);
+    close(listen_fd);
+
+    struct zerocopy zc;
+    int zerocopy = 0;
+    if (mode != TRANSMIT_COPY) {
+        set_nodelay(fd);
+    }
+    if (mode == TRANSMIT_ZEROCOPY) {
+        if (zerocopy_init(&zc, fd) == -1) {
+            perror("bench: zerocopy");
+            printf("%-14s %-6s %6s %14s\n", "transmit", names[mode], "-", "unsupported");
+            close(fd);
+            waitpid(pid, NULL, 0);
+            return;
+        }
+        zerocopy = 1;
+    }
+
+    static char buffer[MAX_FRAME_DATA];
+    memset(buffer, 'x', sizeof(buffer));
+    struct sample_set s = {0};
+    for (int r = 0; r < reps; r++) {
+        double t0 = now_ns();
+        unsigned long long c0 = now_cycles();
+        // Payload bytes, plus the headers, until the receiver has TRANSMIT_BYTES.
+        long left = TRANSMIT_BYTES;
+        while (left > 0) {
+            // The last frame carries at least one byte, even when fewer than
+            // a header's worth of bytes are left.
+            long n = left - FRAME_HEADER_SIZE;
+            if (n > MAX_FRAME_DATA) {
+                n = MAX_FRAME_DATA;
+            } else if (n < 1) {
+                n = 1;
+            }
+            int flags = (left - n - FRAME_HEADER_SIZE > 0) ? MSG_MORE : 0;
+            int result;
+            if (mode == TRANSMIT_COPY) {
+                result = write_frame(fd, 1, FRAME_DATA, buffer, n);
+            } else if (!zerocopy) {
+                result = send_frame(fd, 1, FRAME_DATA, buffer, n, flags);
+            } else {
+                // Wait for a buffer, as the client does.
+                while (zerocopy_buffer(&zc) == NULL) {
+                    struct pollfd pfd = {fd, 0, 0};
+                    poll(&pfd, 1, -1);
+                    if (zerocopy_reap(&zc) == -1) {
+                        perror("bench: recvmsg");
+                        exit(1);
+                    }
+                }
+                result = zerocopy_send_frame(&zc, 1, FRAME_DATA, n, flags);
+            }
+            if (result == -1) {
+                perror("bench: send");
+                exit(1);
+            }
+            left -= n + FRAME_HEADER_SIZE;
+        }
+        char ack;
+        if (read(fd, &ack, 1) != 1) {
+            perror("bench: read");
+            exit(1);
+        }
+        s.cycles[s.n] = (double)(now_cycles() - c0);
+        s.ns[s.n] = now_ns() - t0;
+        s.n++;
+    }
+    report("transmit", names[mode], TRANSMIT_BYTES, &s);
+    if (zerocopy && zc.copied > 0) {
+        printf("%-14s %-6s %ld of %ld zerocopy sends were copied by the kernel\n", "", "",
+               zc.copied, zc.completed);
+    }
+    close(fd);
+    waitpid(pid, NULL, 0);
+}
+
+/*
+ * This function takes a size string such as 64, 4K, 16M or 1G as input and
+ * returns the number of bytes it represents, or -1 if it is malformed.
+ */
+static long parse_size(const char *str) {
+    char *end;
+    long value = strtol(str, &end, 10);
+    if (end == str || value <= 0) {
+        return -1;
+    }
+    switch (*end) {
+        case '\0': return value;
+        case 'K': case 'k': return value << 10;
+        case 'M': case 'm': return value << 20;
+        case 'G': case 'g': return value << 30;
+        default: return -1;
+    }
+}
+
+static void usage(void) {
+    printf("Usage: rcopy_bench [-r REPS] [-m MAXSIZE] [-d DIR]\n");
+    printf("\t REPS - The number of samples per benchmark (default %d)\n", DEFAULT_REPS);
+    printf("\t MAXSIZE - The largest hash input, e.g. 64M (default 1G)\n");
+    printf("\t DIR - The directory for temporary input files (default .)\n");
+}
+
+int main(int argc, char **argv) {
+    int reps = DEFAULT_REPS;
+    long max_size = DEFAULT_MAXSIZE;
+    const char *dir = ".";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:m:d:")) != -1) {
+        switch (opt) {
+            case 'r':
+                reps = atoi(optarg);
+                break;
+            case 'm':
+                max_size = parse_size(optarg);
+                break;
+            case 'd':
+                dir = optarg;
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+    if (optind != argc || reps < 1 || reps > MAX_SAMPLES || max_size < 64) {
+        usage();
+        return 1;
+    }
+
+    printf("%-14s %-6s %6s %14s %8s %10s %10s\n", "benchmark", "cache", "size",
+           "ns/op", "stddev", "cycles/B", "MB/s");
+
+    // Hash inputs grow by 16x from 64 B up to MAXSIZE.
+    for (long size = 64; size <= max_size; size *= 16) {
+        bench_hash(dir, size, reps, 0);
+        bench_hash(dir, size, reps, 1);
+        // Make sure that MAXSIZE itself is measured even if it is not
+        // a power of 16 times 64 B.
+        if (size < max_size && size * 16 > max_size) {
+            bench_hash(dir, max_size, reps, 0);
+            bench_hash(dir, max_size, reps, 1);
+        }
+    }
+
+    bench_check_hash(reps);
+    bench_generate_path(reps, 16);
+    bench_generate_path(reps, 64);
+    bench_generate_path(reps, MAXPATH - 1);
+    bench_write_request(reps);
+    bench_transmit(reps, TRANSMIT_COPY);
+    bench_transmit(reps, TRANSMIT_TUNED);
+    bench_transmit(reps, TRANSMIT_ZEROCOPY);
+    return 0;
+}
@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "content_index.h"
+
+#define INITIAL_CAPACITY 1024
+
+/*
+ * This function takes a hash as input and returns the slot it starts
+ * probing at. The first bytes of a SHA-256 hash are as good as any.
+ */
+static long slot_of(const struct content_index *ci, const char *hash) {
+    unsigned long h;
+    memcpy(&h, hash, sizeof(h));
+    return h & (ci->capacity - 1);
+}
+
+/*
+ * This function takes a content index ci, a hash and a size as inputs,
+ * and returns the slot holding that content, or the empty slot where it
+ * would be inserted.
+ */
+static long probe(const struct content_index *ci, const char *hash, long size) {
+    long i = slot_of(ci, hash);
+    while (ci->slots[i].path != NULL) {
+        if (ci->slots[i].size == size && memcmp(ci->slots[i].hash, hash, HASH_SIZE) == 0) {
+            return i;
+        }
+        i = (i + 1) & (ci->capacity - 1);
+    }
+    return i;
+}
+
+static void grow(struct content_index *ci) {
+    struct content_entry *old = ci->slots;
+    long old_capacity = ci->capacity;
+
+    ci->capacity *= 2;
+    ci->slots = calloc(ci->capacity, sizeof(struct content_entry));
+    if (ci->slots == NULL) {
+        perror("content_index: calloc");
+        exit(1);
+    }
+    for (long i = 0; i < old_capacity; i++) {
+        if (old[i].path != NULL) {
+            ci->slots[probe(ci, old[i].hash, old[i].size)] = old[i];
+        }
+    }
+    free(old);
+}
+
+void content_index_init(struct content_index *ci) {
+    ci->capacity = INITIAL_CAPACITY;
+    ci->count = 0;
+    ci->slots = calloc(ci->capacity, sizeof(struct content_entry));
+    if (ci->slots == NULL) {
+        perror("content_index: calloc");
+        exit(1);
+    }
+}
+
+/*
+ * This function records that path holds the content with the given hash
+ * and size. If that content is already indexed, the newer path replaces
+ * the old one, since it is the one most likely to still be intact.
+ */
+void content_index_add(struct content_index *ci, const char *hash, long size, const char *path) {
+    // Keep the load factor below 1/2 so that probe sequences stay short.
+    if ((ci->count + 1) * 2 > ci->capacity) {
+        grow(ci);
+    }
+    struct content_entry *e = &ci->slots[probe(ci, hash, size)];
+    if (e->path != NULL) {
+        free(e->path);
+    } else {
+        memcpy(e->hash, hash, HASH_SIZE);
+        e->size = size;
+        ci->count++;
+    }
+    e->path = strdup(path);
+}
+
+/*
+ * This function returns a path holding the content with the given hash
+ * and size, or NULL if no such content is known.
+ */
+const char *content_index_find(struct content_index *ci, const char *hash, long size) {
+    return ci->slots[probe(ci, hash, size)].path;
+}
+
+/*
+ * This function forgets the content with the given hash and size, e.g.
+ * because the file it pointed to has been changed or removed.
+ */
+void content_index_remove(struct content_index *ci, const char *hash, long size) {
+    long i = probe(ci, hash, size);
+    if (ci->slots[i].path == NULL) {
+        return;
+    }
+    free(ci->slots[i].path);
+    ci->slots[i].path = NULL;
+    ci->count--;
+
+    // Shift back the entries that follow, so that no probe sequence
+    // is cut short by the hole we just made.
+    long j = i;
+    while (1) {
+        j = (j + 1) & (ci->capacity - 1);
+        if (ci->slots[j].path == NULL) {
+            break;
+        }
+        long home = slot_of(ci, ci->slots[j].hash);
+        // Move j into the hole unless its home lies cyclically in (i, j].
+        if ((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j))) {
+            ci->slots[i] = ci->slots[j];
+            ci->slots[j].path = NULL;
+            i = j;
+        }
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef _CONTENT_INDEX_H_
+#define _CONTENT_INDEX_H_
+
+#include "hash.h"
+
+/*
+ * The content index maps a file hash (and size) to a path on the server
+ * that is known to hold that content. It is an open addressing hash table
+ * keyed by the hash itself, which is already uniformly distributed.
+ */
+struct content_entry {
+    char hash[HASH_SIZE];
+    long size;
+    char *path;             // NULL if the slot is empty
+};
+
+struct content_index {
+    struct content_entry *slots;
+    long capacity;          // always a power of 2
+    long count;
+};
+
+void content_index_init(struct content_index *ci);
+void content_index_add(struct content_index *ci, const char *hash, long size, const char *path);
+const char *content_index_find(struct content_index *ci, const char *hash, long size);
+void content_index_remove(struct content_index *ci, const char *hash, long size);
+
+#endif // _CONTENT_INDEX_H_
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // copy_file_range()
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -7,15 +8,31 @@
 #include <errno.h>
 #include <dirent.h>
 #include <sys/types.h>
-#include <sys/wait.h>
 #include <netdb.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <limits.h>
+#include <poll.h>
+#include <endian.h>
+#include <time.h>
+#include <sys/time.h>
+#include <fnmatch.h>
 
 #include "ftree.h"
-
-#define MAX_BACKLOG 5
+#include "content_index.h"
+#include "tree_index.h"
+#include "inode_index.h"
+#include "pipeline.h"
+#include "mux.h"
+#include "zerocopy.h"
+#include "ratelimit.h"
+
+#define MAX_BACKLOG 128
 // #define ENABLE_DEBUG_LOG
 
 #ifdef ENABLE_DEBUG_LOG
@@ -40,405 +57,2673 @@ char* generate_path(const char *path, char *name) {
         strcpy(result, path);
         strcat(result, name);
     }
-    return result;
+    return result;
+}
+
+/*
+ * This function takes a request struct req and a buffer buf of
+ * REQUEST_SIZE bytes as inputs, and lays out every field of the struct
+ * in buf as it is sent to the server. The order is:
+ * type -> path -> mode -> hash -> size -> mtime.
+ * type, size and mtime are expected in network byte order already.
+ */
+void encode_request(const struct request *req, char *buf) {
+    memcpy(buf, &(req->type), sizeof(int));
+    buf += sizeof(int);
+    memcpy(buf, req->path, MAXPATH);
+    buf += MAXPATH;
+    memcpy(buf, &(req->mode), 4);
+    buf += 4;
+    memcpy(buf, req->hash, BLOCKSIZE);
+    buf += BLOCKSIZE;
+    memcpy(buf, &(req->size), sizeof(int64_t));
+    buf += sizeof(int64_t);
+    memcpy(buf, &(req->mtime), sizeof(int64_t));
+}
+
+/*
+ * This function is the reverse of encode_request(): it takes a buffer buf
+ * of REQUEST_SIZE bytes as input, and fills in the request struct req.
+ * type, size and mtime are left in network byte order.
+ */
+void decode_request(const char *buf, struct request *req) {
+    memcpy(&(req->type), buf, sizeof(int));
+    buf += sizeof(int);
+    memcpy(req->path, buf, MAXPATH);
+    buf += MAXPATH;
+    memcpy(&(req->mode), buf, 4);
+    buf += 4;
+    memcpy(req->hash, buf, BLOCKSIZE);
+    buf += BLOCKSIZE;
+    memcpy(&(req->size), buf, sizeof(int64_t));
+    buf += sizeof(int64_t);
+    memcpy(&(req->mtime), buf, sizeof(int64_t));
+}
+
+/*
+ * This function takes a socket file descriptor fd, a stream and a request
+ * struct req as inputs, and uploads the struct to the server as one
+ * FRAME_REQUEST frame on that stream.
+ * If it succeeds return 0, otherwise return -1 with errno set.
+ */
+int write_request(int fd, int stream, const struct request *req) {
+    char buf[REQUEST_SIZE];
+    encode_request(req, buf);
+    return write_frame(fd, stream, FRAME_REQUEST, buf, REQUEST_SIZE);
+}
+
+/*
+ * This function is write_request() for a file that has moved: the path
+ * it was sent under before, origin, follows the struct in the same frame
+ * (MAXPATH bytes), so that the server can rename its copy instead of
+ * receiving the data again.
+ * If it succeeds return 0, otherwise return -1 with errno set.
+ */
+int write_moved_request(int fd, const struct request *req, const char *origin) {
+    char buf[REQUEST_SIZE + MAXPATH];
+    encode_request(req, buf);
+    memset(buf + REQUEST_SIZE, 0, MAXPATH);
+    strncpy(buf + REQUEST_SIZE, origin, MAXPATH - 1);
+    return write_frame(fd, METADATA_STREAM, FRAME_REQUEST, buf, sizeof(buf));
+}
+
+/*
+ * Client and server settings, from the command line.
+ */
+struct client_options client_options;
+struct server_options server_options;
+
+static struct tree_index src_tree; /* hashes of the source from earlier syncs */
+static struct inode_index sent_files; /* where each source file was sent to */
+static size_t prefix_len; /* paths on the server start after this much */
+
+/*
+ * A server the source is copied to. With several targets, the source is
+ * scanned, hashed and read once: every target gets the same requests and
+ * the same data, but answers them for itself, so each is only sent what
+ * it is missing.
+ */
+struct target {
+    const char *host;
+    int fd;                 // the connection shared by every sync, -1 if lost
+    int local;              // connected through a Unix domain socket
+    struct zerocopy zc;     // buffers for sending data with MSG_ZEROCOPY
+    int zerocopy_enabled;   // SO_ZEROCOPY is set on the connection
+    int use_zerocopy;       // send data with MSG_ZEROCOPY
+    struct token_bucket bucket; // limits the data sent to this target
+    int response;           // to the last request on the metadata stream, -1 if pending
+    long stream_window;     // the window of each stream, as agreed with the server
+    char *skipped;          // per entry of this sync: not sent to this target
+    int skipped_size;       // entries skipped has room for
+    int error;              // something failed on this target in this sync
+    long files_sent;        // in this sync
+    long long bytes_sent;
+};
+static struct target targets[MAX_TARGETS];
+static int num_targets; /* 0 until the first sync */
+static int num_connected; /* targets whose fd isn't -1 */
+static struct token_bucket rate_limit; /* limits the data sent to all targets */
+
+/*
+ * A file whose data is being sent on a stream of its own. Indexed by
+ * stream, so transfers[0] (the metadata stream) is never used. A file
+ * uses the same stream on every target that asked for it, and each frame
+ * is read once and sent to all of them, which is why a frame is only as
+ * large as the smallest of their windows: a slow target holds the file
+ * back for the others (but not the other files), instead of making us
+ * read it twice.
+ */
+struct transfer {
+    int fd;                 // the source file, -1 if the stream is free
+    off_t offset;           // where the next frame starts
+    off_t data_end;         // where the data extent at offset ends
+    off_t left;             // bytes not sent yet
+    char path[MAXPATH];
+    int rank;               // the first priority pattern path matches
+    int bulk;               // larger than BULK_SIZE
+    char waiting[MAX_TARGETS];      // the target hasn't sent its result yet
+    char receiving[MAX_TARGETS];    // the target is sent the data frames
+    long window[MAX_TARGETS];       // bytes the target will still accept
+};
+static struct transfer transfers[MAX_STREAMS + 1];
+static int num_transfers; /* streams in use */
+static int next_transfer = 1; /* where to continue sending, round robin */
+
+/*
+ * A file that servers have asked for, waiting for a free stream. Rather
+ * than in scan order, waiting files are started (and the data of started
+ * ones is sent) by rank first, the index of the first priority pattern
+ * they match, and then, with ORDER_SMALLEST, smallest first. Small files
+ * then get through quickly, and large ones have the link to themselves
+ * the rest of the time. So that large files can't take every stream
+ * while small ones wait behind them, they only get MAX_BULK_STREAMS.
+ */
+struct pending_transfer {
+    char *path;             // absolute path on the client
+    struct request req;     // the request that announced the file
+    off_t size;
+    int rank;
+    char wants[MAX_TARGETS];    // the target answered SENDFILE
+    int unhashed;           // stat-only: the pipeline entry being hashed, else -1
+};
+#define MAX_PENDING 1024
+#define BULK_SIZE (4 * DEFAULT_STREAM_WINDOW)
+#define MAX_BULK_STREAMS (MAX_STREAMS - 2)
+static struct pending_transfer pending[MAX_PENDING];
+static int num_pending;
+static int num_unhashed; /* pending transfers still waiting for their hash */
+static struct pipeline *pipeline; /* of the current sync, which hashes them */
+
+// What pump() waits for.
+#define UNTIL_RESPONSE 0    // the responses on the metadata stream
+#define UNTIL_ROOM 1        // room for another pending transfer
+#define UNTIL_IDLE 2        // every transfer, pending ones too, to be finished
+#define UNTIL_PROGRESS 3    // one round: the pipeline may have progressed
+static int progress_timeout; /* UNTIL_PROGRESS waits this long at most, -1: no limit */
+
+/*
+ * This function takes a target t and the path of an entry that failed on
+ * it as inputs, and reports the failure. The host is only named if there
+ * is more than one target.
+ */
+static void target_error(struct target *t, const char *path) {
+    if (num_targets > 1) {
+        fprintf(stderr, "ERROR: %s (on %s)\n", path, t->host);
+    } else {
+        fprintf(stderr, "ERROR: %s\n", path);
+    }
+    t->error = 1;
+}
+
+/*
+ * This function takes the stream of a transfer, the index k of a target
+ * and that target's result as inputs. Once every target has sent its
+ * result, the stream is freed.
+ */
+static void end_transfer(int stream, int k, int result) {
+    struct transfer *tr = &transfers[stream];
+    if (result != OK) {
+        // upload file to a non-writable dir.
+        fprintf(stderr, "client: transfer ERROR!\n");
+        target_error(&targets[k], tr->path);
+    } else {
+        targets[k].files_sent++;
+    }
+    tr->waiting[k] = 0;
+    tr->receiving[k] = 0;
+    for (int j = 0; j < num_targets; j++) {
+        if (tr->waiting[j]) {
+            return;
+        }
+    }
+    close(tr->fd);
+    tr->fd = -1;
+    num_transfers--;
+}
+
+/*
+ * This function takes a target t whose connection has failed as input,
+ * and stops using it, so that the sync carries on for the other targets.
+ * Whatever t still had in flight counts as failed. The next sync connects
+ * to t again.
+ */
+static void drop_target(struct target *t) {
+    int k = t - targets;
+    close(t->fd);
+    t->fd = -1;
+    t->error = 1;
+    t->response = ERROR;
+    num_connected--;
+    if (num_targets > 1) {
+        fprintf(stderr, "client: lost the connection to %s\n", t->host);
+    }
+    // Whatever the closed socket still sends from them is lost anyway.
+    if (t->zerocopy_enabled) {
+        free(t->zc.buffers);
+        t->zerocopy_enabled = 0;
+        t->use_zerocopy = 0;
+    }
+    for (int s = 1; s <= MAX_STREAMS; s++) {
+        if (transfers[s].fd != -1 && transfers[s].waiting[k]) {
+            end_transfer(s, k, ERROR);
+        }
+    }
+}
+
+/*
+ * This function takes a transfer tr as input and returns how many of its
+ * bytes every target receiving it has room for.
+ */
+static long window_room(const struct transfer *tr) {
+    if (tr->fd == -1 || tr->left == 0) {
+        return 0;
+    }
+    long n = -1;
+    for (int k = 0; k < num_targets; k++) {
+        if (tr->receiving[k] && (n == -1 || tr->window[k] < n)) {
+            n = tr->window[k];
+        }
+    }
+    if (n == -1) {
+        return 0;
+    }
+    return (n < tr->left) ? n : tr->left;
+}
+
+/*
+ * This function takes a transfer tr as input, and returns 0 if the rate
+ * limits let its data be sent now, or otherwise how many milliseconds it
+ * has to wait: for the global limit, and for the limit of every target
+ * receiving it.
+ */
+static int rate_wait(const struct transfer *tr) {
+    int wait = token_bucket_wait(&rate_limit);
+    for (int k = 0; k < num_targets; k++) {
+        if (tr->receiving[k]) {
+            int w = token_bucket_wait(&targets[k].bucket);
+            if (w > wait) {
+                wait = w;
+            }
+        }
+    }
+    return wait;
+}
+
+/*
+ * This function takes a transfer tr as input and returns how many of its
+ * bytes can be sent now.
+ */
+static long sendable(const struct transfer *tr) {
+    long n = window_room(tr);
+    if (n > 0 && rate_wait(tr) > 0) {
+        return 0;
+    }
+    return n;
+}
+
+/*
+ * This function returns how many milliseconds until a transfer that only
+ * waits for the rate limits may send again, or -1 if there is none.
+ */
+static int rate_timeout(void) {
+    int timeout = -1;
+    for (int s = 1; s <= MAX_STREAMS; s++) {
+        if (window_room(&transfers[s]) == 0) {
+            continue;
+        }
+        int w = rate_wait(&transfers[s]);
+        if (w > 0 && (timeout == -1 || w < timeout)) {
+            timeout = w;
+        }
+    }
+    return timeout;
+}
+
+/*
+ * This function returns 1 if some transfer has data that its targets have
+ * room for, and 0 otherwise.
+ */
+static int data_ready(void) {
+    for (int s = 1; s <= MAX_STREAMS; s++) {
+        if (sendable(&transfers[s]) > 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * This function takes a transfer t whose offset is at the end of a data
+ * extent as input, and finds the next one with SEEK_DATA/SEEK_HOLE,
+ * setting data_end. It returns where the extent starts, or the end of
+ * the file if only a hole is left. On a file system that doesn't know
+ * about holes, the whole rest of the file is one extent.
+ */
+static off_t next_extent(struct transfer *t) {
+    off_t end = t->offset + t->left;
+    off_t data = lseek(t->fd, t->offset, SEEK_DATA);
+    if (data == -1) {
+        data = (errno == ENXIO) ? end : t->offset;
+    }
+    if (data > end) {
+        data = end;
+    }
+    off_t hole = (data < end) ? lseek(t->fd, data, SEEK_HOLE) : end;
+    if (hole == -1 || hole > end) {
+        hole = end;
+    }
+    t->data_end = hole;
+    return data;
+}
+
+/*
+ * This function takes a transfer t and the stream it is on as inputs, and
+ * if t is at a hole, tells its targets how long the hole is instead of
+ * sending its zeros. It returns 1 if it sent a hole, and 0 otherwise.
+ */
+static int send_hole(struct transfer *t, int stream) {
+    if (t->offset < t->data_end) {
+        return 0;
+    }
+    off_t data = next_extent(t);
+    if (data == t->offset) {
+        return 0;
+    }
+    uint64_t length = data - t->offset;
+    unsigned char payload[8];
+    for (int i = 0; i < 8; i++) {
+        payload[i] = length >> (56 - i * 8);
+    }
+    t->offset = data;
+    t->left -= length;
+    for (int k = 0; k < num_targets; k++) {
+        if (t->receiving[k] &&
+            write_frame(targets[k].fd, stream, FRAME_HOLE, payload, sizeof(payload)) == -1) {
+            perror("client: write");
+            drop_target(&targets[k]);
+        }
+    }
+    return 1;
+}
+
+/*
+ * This function takes two transfers a and b as inputs, and returns 1 if
+ * a's data goes before b's (see struct pending_transfer), and 0 otherwise.
+ */
+static int goes_first(const struct transfer *a, const struct transfer *b) {
+    if (a->rank != b->rank) {
+        return a->rank < b->rank;
+    }
+    return client_options.order == ORDER_SMALLEST && a->left < b->left;
+}
+
+/*
+ * This function sends the next frame of data of the transfer that goes
+ * first among those its targets have room for. Transfers that are equal
+ * take turns, going round robin over the streams so that they all make
+ * progress. Holes are skipped (see send_hole()). It returns 0 if it had
+ * nothing to send.
+ */
+static int send_next_data(void) {
+    static char copy_buffer[MAX_FRAME_DATA];
+    char *buffer = copy_buffer;
+    // Zerocopy is only used with a single target (see connect_tcp()).
+    struct target *zt = &targets[0];
+    if (zt->use_zerocopy && (buffer = zerocopy_buffer(&zt->zc)) == NULL) {
+        // Wait for the kernel to finish with a buffer.
+        return 0;
+    }
+    int stream = 0;
+    long n = 0;
+    for (int i = 0; i < MAX_STREAMS; i++) {
+        int s = (next_transfer - 1 + i) % MAX_STREAMS + 1;
+        long room = sendable(&transfers[s]);
+        if (room > 0 && (stream == 0 || goes_first(&transfers[s], &transfers[stream]))) {
+            stream = s;
+            n = room;
+        }
+    }
+    if (stream == 0) {
+        return 0;
+    }
+    struct transfer *t = &transfers[stream];
+    next_transfer = stream % MAX_STREAMS + 1;
+    if (send_hole(t, stream)) {
+        return 1;
+    }
+
+    if (n > MAX_FRAME_DATA) {
+        n = MAX_FRAME_DATA;
+    }
+    if (n > t->data_end - t->offset) {
+        n = t->data_end - t->offset;
+    }
+    ssize_t bytes = pread(t->fd, buffer, n, t->offset);
+    if (bytes <= 0) {
+        // The file has shrunk (or can't be read any more) since it was
+        // hashed. An empty frame ends it early, and the server will
+        // answer ERROR.
+        if (bytes == -1) {
+            perror("client: read");
+        }
+        bytes = 0;
+        t->left = 0;
+    }
+    t->offset += bytes;
+    t->left -= bytes;
+    for (int k = 0; k < num_targets; k++) {
+        if (t->receiving[k]) {
+            t->window[k] -= bytes;
+            token_bucket_take(&targets[k].bucket, bytes);
+            token_bucket_take(&rate_limit, bytes);
+        }
+    }
+
+    // Let the kernel hold back a partial segment if another data frame
+    // follows right away; requests are sent without MSG_MORE, so they
+    // flush it.
+    int flags = data_ready() ? MSG_MORE : 0;
+    for (int k = 0; k < num_targets; k++) {
+        struct target *tg = &targets[k];
+        if (!t->receiving[k]) {
+            continue;
+        }
+        int result;
+        if (tg->use_zerocopy) {
+            result = zerocopy_send_frame(&tg->zc, stream, FRAME_DATA, bytes, flags);
+        } else {
+            result = send_frame(tg->fd, stream, FRAME_DATA, buffer, bytes, flags);
+        }
+        if (result == -1) {
+            perror("client: write");
+            drop_target(tg);
+            continue;
+        }
+        tg->bytes_sent += bytes;
+    }
+    return 1;
+}
+
+/*
+ * This function takes the index k of a target whose connection has
+ * something to read as input, and reads one frame from it: a response on
+ * the metadata stream, or the result of or a window update for one of
+ * its transfers.
+ */
+static void read_from_target(int k) {
+    struct target *t = &targets[k];
+    struct frame_header h;
+    int tmp, value;
+    if (read_frame_header(t->fd, &h) == -1 || h.length != sizeof(int) ||
+        read_full(t->fd, &tmp, sizeof(int)) == -1) {
+        if (errno == 0) {
+            fprintf(stderr, "client: connection closed by the server\n");
+        } else {
+            perror("client: read");
+        }
+        drop_target(t);
+        return;
+    }
+    value = ntohl(tmp);
+
+    if (h.stream == METADATA_STREAM && h.type == FRAME_RESPONSE && t->response == -1) {
+        t->response = value;
+    } else if (h.stream == METADATA_STREAM && h.type == FRAME_WINDOW && value >= MIN_STREAM_WINDOW) {
+        // The server's window; it comes before the answer to any request.
+        t->stream_window = (value < client_options.stream_window) ? value : client_options.stream_window;
+    } else if (h.stream > 0 && h.stream <= MAX_STREAMS && transfers[h.stream].fd != -1 &&
+               transfers[h.stream].waiting[k]) {
+        if (h.type == FRAME_RESPONSE) {
+            end_transfer(h.stream, k, value);
+        } else if (h.type == FRAME_WINDOW) {
+            transfers[h.stream].window[k] += value;
+        }
+    } else {
+        fprintf(stderr, "ERROR frame received from the sever!\n");
+        drop_target(t);
+    }
+}
+
+/*
+ * This function takes a pending transfer pt as input, and starts sending
+ * the file's data to the targets that asked for it on a free stream,
+ * which there must be. The data itself is sent by pump() alongside the
+ * requests that follow.
+ */
+static void start_transfer(const struct pending_transfer *pt) {
+    int fd = open(pt->path, O_RDONLY);
+    if (fd == -1) {
+        perror("client: open");
+        for (int k = 0; k < num_targets; k++) {
+            if (pt->wants[k]) {
+                target_error(&targets[k], pt->req.path);
+            }
+        }
+        return;
+    }
+
+    int stream = 1;
+    while (transfers[stream].fd != -1) {
+        stream++;
+    }
+    struct transfer *t = &transfers[stream];
+    t->fd = fd;
+    t->offset = 0;
+    t->data_end = 0;
+    t->left = pt->size;
+    t->rank = pt->rank;
+    t->bulk = pt->size > BULK_SIZE;
+    strcpy(t->path, pt->req.path);
+    memset(t->waiting, 0, sizeof(t->waiting));
+    memset(t->receiving, 0, sizeof(t->receiving));
+    num_transfers++;
+
+    // Identifies as TRANSFILE and send request struct on the new stream.
+    struct request transfer_req = pt->req;
+    transfer_req.type = htonl(TRANSFILE);
+    for (int k = 0; k < num_targets; k++) {
+        struct target *tg = &targets[k];
+        if (!pt->wants[k] || tg->fd == -1) {
+            continue;
+        }
+        if (write_request(tg->fd, stream, &transfer_req) == -1) {
+            perror("client: write");
+            drop_target(tg);
+            continue;
+        }
+        t->waiting[k] = 1;
+        t->window[k] = tg->stream_window;
+        if (tg->local && pt->size > 0) {
+            // The server copies the file itself, straight from our descriptor.
+            if (send_fd_frame(tg->fd, stream, fd) == -1) {
+                perror("client: sendmsg");
+                drop_target(tg);
+            }
+        } else {
+            t->receiving[k] = 1;
+        }
+    }
+
+    // Every target may have been lost on the way.
+    for (int k = 0; k < num_targets; k++) {
+        if (t->waiting[k]) {
+            return;
+        }
+    }
+    if (t->fd != -1) {
+        close(t->fd);
+        t->fd = -1;
+        num_transfers--;
+    }
+}
+
+/*
+ * This function takes a pending transfer pt that waits for its hash as
+ * input, and checks whether the hash threads are done with it. The
+ * servers verify what they receive, so a file that is sent needs its hash
+ * even in stat-only mode. It returns 0 once pt can be started, 1 while
+ * it still has to wait, and -1 if the file couldn't be hashed, which has
+ * been reported.
+ */
+static int check_hashed(struct pending_transfer *pt) {
+    int err = pipeline_wanted_hash(pipeline, pt->unhashed, pt->req.hash);
+    if (err == -1) {
+        return 1;
+    }
+    pt->unhashed = -1;
+    num_unhashed--;
+    if (err != 0) {
+        fprintf(stderr, "client: fopen: %s\n", strerror(err));
+        for (int k = 0; k < num_targets; k++) {
+            if (pt->wants[k]) {
+                target_error(&targets[k], pt->req.path);
+            }
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * This function starts pending transfers while there are free streams,
+ * the one that goes first (see struct pending_transfer) each time. Among
+ * equals, the one that has waited longest goes first. Transfers whose
+ * hash isn't known yet are passed over until it is.
+ */
+static void start_pending(void) {
+    // Drop the files that couldn't be hashed.
+    if (num_unhashed > 0) {
+        int kept = 0;
+        for (int i = 0; i < num_pending; i++) {
+            if (pending[i].unhashed != -1 && check_hashed(&pending[i]) == -1) {
+                free(pending[i].path);
+                continue;
+            }
+            pending[kept++] = pending[i];
+        }
+        num_pending = kept;
+    }
+    while (num_pending > 0 && num_transfers < MAX_STREAMS) {
+        int num_bulk = 0;
+        for (int s = 1; s <= MAX_STREAMS; s++) {
+            num_bulk += (transfers[s].fd != -1 && transfers[s].bulk);
+        }
+        int best = -1;
+        for (int i = 0; i < num_pending; i++) {
+            const struct pending_transfer *a = &pending[i];
+            if (a->size > BULK_SIZE && num_bulk >= MAX_BULK_STREAMS) {
+                continue;
+            }
+            if (a->unhashed != -1) {
+                continue;
+            }
+            if (best == -1) {
+                best = i;
+                continue;
+            }
+            const struct pending_transfer *b = &pending[best];
+            if (a->rank < b->rank || (a->rank == b->rank &&
+                client_options.order == ORDER_SMALLEST && a->size < b->size)) {
+                best = i;
+            }
+        }
+        if (best == -1) {
+            return;
+        }
+        struct pending_transfer pt = pending[best];
+        memmove(pending + best, pending + best + 1,
+                (num_pending - best - 1) * sizeof(struct pending_transfer));
+        num_pending--;
+        start_transfer(&pt);
+        free(pt.path);
+    }
+}
+
+/*
+ * This function takes one of UNTIL_RESPONSE, UNTIL_ROOM, UNTIL_IDLE or
+ * UNTIL_PROGRESS as input, and keeps the connections busy until that
+ * happens: it starts pending transfers as streams become free, sends file
+ * data whenever the sockets have room and the rate limits allow, and reads
+ * results and window updates as they come. For UNTIL_RESPONSE, the
+ * responses are left in each target's response.
+ */
+static void pump(int until) {
+    while (1) {
+        // Without a server, nothing that is waiting can happen any more.
+        if (num_connected == 0) {
+            for (int i = 0; i < num_pending; i++) {
+                free(pending[i].path);
+            }
+            num_pending = 0;
+            num_unhashed = 0;
+            return;
+        }
+        start_pending();
+        if (until == UNTIL_RESPONSE) {
+            int waiting = 0;
+            for (int k = 0; k < num_targets; k++) {
+                waiting |= (targets[k].response == -1);
+            }
+            if (!waiting) {
+                return;
+            }
+        }
+        if (until == UNTIL_ROOM && num_pending < MAX_PENDING) {
+            return;
+        }
+        if (until == UNTIL_IDLE && num_transfers == 0 && num_pending == 0) {
+            return;
+        }
+
+        // Only ask for room to write if there is something to send, and
+        // then on every connection that the data goes to, since each
+        // frame is sent to all of them. If the data is only held back by
+        // the rate limits, wake up once they let it go.
+        // Zerocopy completions are signalled with POLLERR. The pipeline
+        // signals when an entry the sender waits for (or a transfer's
+        // hash) may be ready.
+        struct pollfd pfds[MAX_TARGETS + 1];
+        int ready = data_ready() &&
+                    (!targets[0].use_zerocopy || zerocopy_buffer(&targets[0].zc) != NULL);
+        for (int k = 0; k < num_targets; k++) {
+            pfds[k].fd = targets[k].fd;
+            pfds[k].events = POLLIN;
+            pfds[k].revents = 0;
+            for (int s = 1; ready && s <= MAX_STREAMS; s++) {
+                if (transfers[s].fd != -1 && transfers[s].receiving[k]) {
+                    pfds[k].events |= POLLOUT;
+                    break;
+                }
+            }
+        }
+        int num_pfds = num_targets;
+        if (pipeline != NULL) {
+            pfds[num_pfds].fd = pipeline->wake_fd;
+            pfds[num_pfds].events = POLLIN;
+            pfds[num_pfds].revents = 0;
+            num_pfds++;
+        }
+        int timeout = ready ? -1 : rate_timeout();
+        if (until == UNTIL_PROGRESS && progress_timeout != -1 &&
+            (timeout == -1 || progress_timeout < timeout)) {
+            timeout = progress_timeout;
+        }
+        if (poll(pfds, num_pfds, timeout) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("client: poll");
+            exit(1);
+        }
+        if (num_pfds > num_targets && (pfds[num_targets].revents & POLLIN)) {
+            char drain[64];
+            while (read(pipeline->wake_fd, drain, sizeof(drain)) > 0);
+        }
+
+        int writable = 0;
+        for (int k = 0; k < num_targets; k++) {
+            struct target *t = &targets[k];
+            if (t->fd == -1) {
+                continue;
+            }
+            if (t->zerocopy_enabled && (pfds[k].revents & POLLERR)) {
+                long completed = t->zc.completed;
+                if (zerocopy_reap(&t->zc) == -1) {
+                    perror("client: recvmsg");
+                    exit(1);
+                }
+                // Otherwise it is a real error, and reading will report it.
+                if (t->zc.completed != completed) {
+                    pfds[k].revents &= ~POLLERR;
+                }
+                // If the kernel has to copy anyway (e.g. over loopback, or a
+                // NIC without scatter-gather), zerocopy only adds overhead.
+                if (t->use_zerocopy && t->zc.completed >= ZEROCOPY_BUFFERS &&
+                    t->zc.copied == t->zc.completed) {
+                    printf("Zerocopy: the kernel copies the data anyway, sending by copying instead.\n");
+                    t->use_zerocopy = 0;
+                }
+            }
+            if (pfds[k].revents & (POLLIN | POLLHUP | POLLERR)) {
+                read_from_target(k);
+            } else if (pfds[k].revents & POLLOUT) {
+                writable = 1;
+            }
+        }
+        // A frame goes to every target of its file; a target whose socket
+        // is still full makes the send wait for it.
+        if (writable) {
+            send_next_data();
+        }
+        if (until == UNTIL_PROGRESS) {
+            return;
+        }
+    }
+}
+
+/*
+ * This function takes the sync entry e of a regular file, the request
+ * struct req that announced it, which targets asked for it (wants,
+ * indexed like targets) and the pipeline entry that is being hashed for
+ * it (or -1) as inputs, and queues the file to be sent (see
+ * start_pending()), first waiting for room if the queue is full. Its rank
+ * is the index of the first priority pattern its path matches, where *
+ * also matches /.
+ */
+static void queue_transfer(const struct sync_entry *e, const struct request *req, const char *wants,
+                           int unhashed) {
+    pump(UNTIL_ROOM);
+    struct pending_transfer *pt = &pending[num_pending++];
+    pt->path = strdup(e->path);
+    pt->req = *req;
+    pt->size = e->size;
+    pt->unhashed = unhashed;
+    num_unhashed += (unhashed != -1);
+    pt->rank = client_options.num_priority;
+    for (int i = 0; i < client_options.num_priority; i++) {
+        if (fnmatch(client_options.priority[i], req->path, 0) == 0) {
+            pt->rank = i;
+            break;
+        }
+    }
+    memcpy(pt->wants, wants, MAX_TARGETS);
+    start_pending();
+}
+
+/*
+ * This function takes a target t with its host set and a port as inputs,
+ * and connects to the server over TCP, tuned for file data (see mux.c).
+ * It returns 0, or -1 if the server can't be reached.
+ */
+static int connect_tcp(struct target *t, unsigned short port) {
+    // Get hostname.
+    struct hostent *hp;
+    if ((hp = gethostbyname(t->host)) == NULL) {
+        perror("client: gethostbyname");
+        return -1;
+    }
+
+    // Set the IP and port of the server to connect to.
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    server.sin_addr = *((struct in_addr *)hp->h_addr);
+
+    // Connect to the server. Everything, including file data, goes
+    // over this one connection.
+    if ((t->fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+        perror("client: socket");
+        return -1;
+    }
+    // The send buffer must hold all the data flow control allows in
+    // flight, or the streams' windows can never be used up.
+    size_socket_buffer(t->fd, SO_SNDBUF, CONNECTION_WINDOW(client_options.stream_window));
+    if (connect(t->fd, (struct sockaddr *)&server, sizeof(server)) == -1) {
+        perror("client: connect");
+        close(t->fd);
+        t->fd = -1;
+        return -1;
+    }
+    set_nodelay(t->fd);
+    // A zerocopy buffer can't be shared by several connections, so with
+    // more than one target the data is copied.
+    if (client_options.zerocopy && num_targets == 1) {
+        if (zerocopy_init(&t->zc, t->fd) == -1) {
+            perror("client: zerocopy");
+            fprintf(stderr, "Sending by copying instead.\n");
+        } else {
+            t->zerocopy_enabled = 1;
+            t->use_zerocopy = 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * This function takes a target t and the path of its server's Unix domain
+ * socket as inputs, and connects to it. Files are then passed to the
+ * server instead of being sent, and the server copies them directly.
+ * It returns 0, or -1 if the server can't be reached.
+ */
+static int connect_local(struct target *t, const char *path) {
+    struct sockaddr_un local;
+    memset(&local, 0, sizeof(local));
+    local.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(local.sun_path)) {
+        fprintf(stderr, "client: socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(local.sun_path, path);
+
+    if ((t->fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        perror("client: socket");
+        return -1;
+    }
+    if (connect(t->fd, (struct sockaddr *)&local, sizeof(local)) == -1) {
+        perror("client: connect");
+        close(t->fd);
+        t->fd = -1;
+        return -1;
+    }
+    t->local = 1;
+    return 0;
+}
+
+/*
+ * This function takes a target t and the index i of an entry of the sync
+ * as inputs, and records whether t has been left out of the entry (and so
+ * of everything below it).
+ */
+static void set_skipped(struct target *t, int i, int skipped) {
+    if (i >= t->skipped_size) {
+        int size = (t->skipped_size > 0) ? t->skipped_size : 1024;
+        while (size <= i) {
+            size *= 2;
+        }
+        t->skipped = realloc(t->skipped, size);
+        if (t->skipped == NULL) {
+            perror("client: realloc");
+            exit(1);
+        }
+        t->skipped_size = size;
+    }
+    t->skipped[i] = skipped;
+}
+
+/*
+ * This function takes a regular file e of the source as input, and
+ * returns the path (relative to the server's dest) it was sent under by an
+ * earlier sync if it has been moved since, or NULL otherwise. A file only
+ * counts as moved if nothing else links to it and its old path is gone or
+ * holds a different file now; a copy is a new file, so it doesn't count.
+ */
+static const char *moved_from(const struct sync_entry *e) {
+    if (e->nlink != 1) {
+        return NULL;
+    }
+    const char *old = inode_index_find(&sent_files, e->dev, e->ino);
+    if (old == NULL || strcmp(old, e->path) == 0 || strlen(old + prefix_len) >= MAXPATH) {
+        return NULL;
+    }
+    struct stat stat_old;
+    if (lstat(old, &stat_old) == 0 && stat_old.st_dev == e->dev && stat_old.st_ino == e->ino) {
+        return NULL;
+    }
+    return old + prefix_len;
+}
+
+/*
+ * This function takes the pipeline p and an entry index i as inputs, and
+ * waits until entry i can be sent, copying it to e (see pipeline_poll()).
+ * The connections are kept busy meanwhile. It returns 0, or -1 if there
+ * is no entry i or there is no server left to send it to.
+ */
+static int next_entry(struct pipeline *p, int i, struct sync_entry *e) {
+    int result = -1;
+    while (num_connected > 0 && (result = pipeline_poll(p, i, e, &progress_timeout)) == 1) {
+        pump(UNTIL_PROGRESS);
+    }
+    return num_connected > 0 ? result : -1;
+}
+
+/*
+ * This function takes the path of a directory on the server and its mode
+ * as inputs, and sends the directory to the servers without anything
+ * below it, e.g. because only its mode has changed. It returns 0, or 1 if
+ * it failed on a server.
+ */
+static int sync_dir_only(const char *rel_path, mode_t mode) {
+    if (strlen(rel_path) >= MAXPATH) {
+        fprintf(stderr, "Path too long!\n");
+        fprintf(stderr, "ERROR: %s\n", rel_path);
+        return 1;
+    }
+    // Without its digest, the server only looks at the directory itself.
+    struct request req_src;
+    memset(&req_src, 0, sizeof(req_src));
+    req_src.type = htonl(REGDIR);
+    strcpy(req_src.path, rel_path);
+    req_src.mode = mode;
+    for (int k = 0; k < num_targets; k++) {
+        struct target *t = &targets[k];
+        if (t->fd == -1) {
+            t->response = ERROR;
+            continue;
+        }
+        t->response = -1;
+        if (write_request(t->fd, METADATA_STREAM, &req_src) == -1) {
+            perror("client: write");
+            drop_target(t);
+        }
+    }
+    pump(UNTIL_RESPONSE);
+    int neg_flag = 0;
+    for (int k = 0; k < num_targets; k++) {
+        struct target *t = &targets[k];
+        if (t->response != OK && t->response != SKIPDIR) {
+            if (t->fd != -1) {
+                target_error(t, req_src.path);
+            }
+            neg_flag = 1;
+        }
+    }
+    return neg_flag;
+}
+
+/*
+ * This function takes string of source path, an array of num_hosts hosts,
+ * a unsigned short of port and whether to descend into directories
+ * (recursive) to intialize a client to synchronize files with every one
+ * of the servers.
+ *
+ * The source is scanned and hashed by a pipeline of threads (see
+ * pipeline.c), while this function sends each entry to the servers in
+ * scan order as soon as it is ready, so that the disk, the CPUs and the
+ * network are all busy at once. Every server decides for itself which
+ * entries it needs, but the source is only read once for all of them.
+ *
+ * It returns 0 on success, 1 if anything failed, or SYNC_DISCONNECTED if
+ * a server couldn't be reached or was lost during the sync. The servers
+ * are connected to again on the next call.
+ */
+int rcopy_client(char *source, char **hosts, int num_hosts, unsigned short port, int recursive) {
+    int neg_flag = 0; /* error indicator */
+
+    // Check if the file exits.
+    struct stat stat_src;
+    if (lstat(source, &stat_src) == -1) {
+        perror("client: lstat");
+        return 1;
+    }
+    // Ignore LINKS.
+    if (S_ISLNK(stat_src.st_mode)) {
+        return 0;
+    }
+
+    // Get absolute path.
+    char abs_src[PATH_MAX];
+    if (realpath(source, abs_src) == NULL) {
+        perror("client: realpath");
+        return 1;
+    }
+
+    // First, set up socket connections.
+    // Note: only establish once, later calls (the ones made by watch
+    // mode) reuse them, and only reconnect the ones that were lost.
+    if (num_targets == 0) {
+        // Paths on the server start at the basename of the first source.
+        char *parent = strdup(abs_src);
+        prefix_len = strlen(dirname(parent));
+        prefix_len += (prefix_len == 1) ? 0 : 1;
+        free(parent);
+
+        num_targets = num_hosts;
+        for (int k = 0; k < num_targets; k++) {
+            targets[k].host = hosts[k];
+            targets[k].fd = -1;
+            token_bucket_init(&targets[k].bucket, client_options.target_rate);
+        }
+        token_bucket_init(&rate_limit, client_options.rate);
+        if (client_options.zerocopy && num_targets > 1) {
+            printf("Zerocopy: only used with a single HOST, sending by copying instead.\n");
+        }
+        tree_index_init(&src_tree);
+        inode_index_init(&sent_files);
+        for (int s = 0; s <= MAX_STREAMS; s++) {
+            transfers[s].fd = -1;
+        }
+    }
+    int reconnected = 0;
+    for (int k = 0; k < num_targets; k++) {
+        struct target *t = &targets[k];
+        if (t->fd != -1) {
+            continue;
+        }
+        // A server on this host may be reached through its Unix domain socket.
+        if (strncmp(t->host, LOCAL_PREFIX, strlen(LOCAL_PREFIX)) == 0
+                ? connect_local(t, t->host + strlen(LOCAL_PREFIX)) == 0
+                : connect_tcp(t, port) == 0) {
+            // Until the server's window arrives, it is taken to be the default.
+            t->stream_window = (client_options.stream_window < DEFAULT_STREAM_WINDOW)
+                ? client_options.stream_window : DEFAULT_STREAM_WINDOW;
+            if (write_frame_int(t->fd, METADATA_STREAM, FRAME_WINDOW,
+                                client_options.stream_window) == -1) {
+                perror("client: write");
+                close(t->fd);
+                t->fd = -1;
+                continue;
+            }
+            num_connected++;
+            reconnected = 1;
+        }
+    }
+    if (num_connected == 0) {
+        return SYNC_DISCONNECTED;
+    }
+    if (reconnected) {
+        printf("Socket connection established.\n");
+    }
+    for (int k = 0; k < num_targets; k++) {
+        targets[k].error = (targets[k].fd == -1);
+        targets[k].files_sent = 0;
+        targets[k].bytes_sent = 0;
+    }
+
+    if (S_ISDIR(stat_src.st_mode) && !recursive) {
+        neg_flag = sync_dir_only(abs_src + prefix_len, stat_src.st_mode);
+        return num_connected < num_targets ? SYNC_DISCONNECTED : neg_flag;
+    }
+
+    // In stat-only mode files are only hashed if a server asks for them.
+    int num_hashers = client_options.hash_threads;
+    if (num_hashers <= 0) {
+        num_hashers = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    }
+    struct pipeline p;
+    pipeline_start(&p, abs_src, prefix_len, &src_tree, num_hashers, client_options.stat_only);
+    pipeline = &p;
+
+    struct sync_entry e;
+    for (int i = 0; next_entry(&p, i, &e) == 0; i++) {
+        // Everything below a directory that was skipped or failed.
+        if (e.skip) {
+            continue;
+        }
+
+        // Next, construct request struct.
+        struct request req_src;
+        memset(&req_src, 0, sizeof(req_src));
+        if (strlen(e.rel_path) >= MAXPATH) {
+            fprintf(stderr, "Path too long!\n");
+            fprintf(stderr, "ERROR: %s\n", e.rel_path);
+            pipeline_skip(&p, i);
+            neg_flag = 1;
+            continue;
+        }
+        strcpy(req_src.path, e.rel_path); /* Path */
+        req_src.mode = e.mode; /* Mode */
+        req_src.size = htobe64(e.size); /* Size */
+
+        // Construct fields of request struct for REGULAR FILE.
+        if (S_ISREG(e.mode)) {
+            if (e.state == ENTRY_FAILED) {
+                // try to upload a non-readable file, or one that was
+                // removed since we saw it
+                fprintf(stderr, "client: fopen: %s\n", strerror(e.error));
+                fprintf(stderr, "ERROR: %s\n", req_src.path);
+                neg_flag = 1;
+                continue;
+            }
+            // Type; in stat-only mode the server goes by size and mtime.
+            req_src.type = htonl(client_options.stat_only ? STATFILE : REGFILE);
+            memcpy(req_src.hash, e.hash, HASH_SIZE); /* Hash, if known */
+            req_src.mtime = htobe64(e.mtime); /* Mtime */
+
+        // Construct fields of request struct for DIRECTORY
+        } else {
+            req_src.type = htonl(REGDIR); /* Type */
+            /*
+             * Hash
+             * The hash of a dir is the Merkle digest of everything below it,
+             * which lets the server skip the whole subtree if nothing has
+             * changed. If it isn't known (yet), e.g. because a file isn't
+             * readable or still being hashed, it stays all \0 and the
+             * server compares entry by entry.
+             */
+            if (e.state == ENTRY_READY) {
+                memcpy(req_src.hash, e.hash, HASH_SIZE);
+            }
+        }
+
+        // Then upload this struct to every server that still goes this
+        // far down. If the file was only moved, the servers may still
+        // have it under its old path.
+        const char *origin = S_ISREG(e.mode) ? moved_from(&e) : NULL;
+        for (int k = 0; k < num_targets; k++) {
+            struct target *t = &targets[k];
+            set_skipped(t, i, t->fd == -1 || (e.parent >= 0 && t->skipped[e.parent]));
+            if (t->skipped[i]) {
+                t->response = SKIPDIR;
+                continue;
+            }
+            t->response = -1;
+            if ((origin != NULL ? write_moved_request(t->fd, &req_src, origin)
+                                : write_request(t->fd, METADATA_STREAM, &req_src)) == -1) {
+                perror("client: write");
+                drop_target(t);
+            }
+        }
+        if (S_ISREG(e.mode) && e.nlink == 1) {
+            inode_index_add(&sent_files, e.dev, e.ino, e.path);
+        }
+
+        // After, wait for the responses from the servers, sending file
+        // data in the meantime.
+        pump(UNTIL_RESPONSE);
+
+        char wants[MAX_TARGETS] = {0};
+        int num_wants = 0, num_ok = 0, num_descend = 0;
+        for (int k = 0; k < num_targets; k++) {
+            struct target *t = &targets[k];
+            if (t->skipped[i]) {
+                continue;
+            }
+            int rec_int = t->response;
+
+            // if server responds ERROR: report error, and don't descend.
+            if (rec_int == ERROR) {
+                if (t->fd != -1) {
+                    target_error(t, req_src.path);
+                }
+                set_skipped(t, i, 1);
+
+            // if server responds OK, current file identical with server, or
+            // the directory exists and we go on with its entries.
+            } else if (rec_int == OK) {
+                num_ok++;
+
+            // if server responds SKIPDIR, nothing below this directory has changed.
+            } else if (rec_int == SKIPDIR) {
+                set_skipped(t, i, 1);
+
+            // if server responds SENDFILE, file data are different, file needs to be send.
+            } else if (rec_int == SENDFILE) {
+                wants[k] = 1;
+                num_wants++;
+
+            // if server responds strange message.
+            } else {
+                fprintf(stderr, "ERROR int received from the sever!\n");
+                drop_target(t);
+                set_skipped(t, i, 1);
+            }
+            num_descend += !t->skipped[i];
+        }
+        if (num_descend == 0) {
+            pipeline_skip(&p, i);
+        }
+
+        if (num_ok > 0 && S_ISDIR(e.mode) && e.error != 0) {
+            // if no read permission, error.
+            fprintf(stderr, "client: opendir: %s\n", strerror(e.error));
+            fprintf(stderr, "ERROR: %s\n", req_src.path);
+            neg_flag = 1;
+        }
+        if (num_wants > 0) {
+            // The servers verify what they receive, so a file that is
+            // sent needs its hash after all. The hash threads compute it
+            // while the sender goes on.
+            if (e.state == ENTRY_UNHASHED) {
+                pipeline_want_hash(&p, i);
+            }
+            // Send file data on a stream of its own, once it is its turn.
+            queue_transfer(&e, &req_src, wants, e.state == ENTRY_UNHASHED ? i : -1);
+        }
+    }
+
+    // Every server may have been lost, then the rest waits for the next
+    // sync and needn't be hashed.
+    if (num_connected == 0) {
+        pipeline_skip(&p, 0);
+    }
+    // Finally, wait for all transfers. They may still need the pipeline
+    // for their hashes.
+    pump(UNTIL_IDLE);
+    if (pipeline_finish(&p) != 0) {
+        neg_flag = 1;
+    }
+    pipeline = NULL;
+    for (int k = 0; k < num_targets; k++) {
+        struct target *t = &targets[k];
+        if (t->error) {
+            neg_flag = 1;
+        }
+        if (num_targets > 1) {
+            printf("%s: %ld file(s), %lld bytes sent%s\n", t->host, t->files_sent, t->bytes_sent,
+                   t->fd == -1 ? ", connection lost" : (t->error ? ", with errors" : ""));
+        }
+    }
+    if (num_connected < num_targets) {
+        return SYNC_DISCONNECTED;
+    }
+    return neg_flag;
+}
+
+// ================ client part ends ================
+
+
+
+// ================ server part starts ================
+
+/*
+ * The state of one transfer stream of a client connection.
+ */
+struct server_stream {
+    int state;              // AWAITING_REQUEST, AWAITING_DATA or DISCARDING_DATA
+    struct request req;     // the TRANSFILE request, type and size in host order
+    off_t offset;           // where the next data goes
+    off_t data_left;
+    int fd;                 // the file being received, or -1
+    int admitted;           // counts against the admission limits
+    long queued;            // waiting for admission: its place in the queue, else 0
+    long credit;            // bytes the client may send without a window update
+    long withheld;          // window updates held back by the admission limits
+};
+
+/*
+ * This function takes a stream st as input, and closes the file it was
+ * receiving, if any. If it succeeds return 0, otherwise return -1.
+ */
+static int close_received_file(struct server_stream *st) {
+    if (st->fd == -1) {
+        return 0;
+    }
+    int result = close(st->fd);
+    st->fd = -1;
+    if (result == -1) {
+        perror("server: close");
+    }
+    return result;
+}
+
+/*
+ * Admission control: so that one client (e.g. one that opens hundreds of
+ * connections) can't take all of the server's disk bandwidth and memory,
+ * the transfers of each client, by peer address, and of all clients
+ * together are limited in number and in the bytes they may have in flight
+ * (that the client may send before it needs another window update).
+ *
+ * A transfer over the limits is queued: it doesn't count, and gets no
+ * window updates, until it is admitted, oldest first among the clients
+ * that are under their limits. A connection whose transfers are all
+ * queued isn't read at all, so TCP pushes back on the client. (One with
+ * admitted transfers must be read for their data, but a queued transfer
+ * can't send more than its first window.) Window updates of admitted
+ * transfers are held back while the bytes in flight are at a limit.
+ */
+struct peer {
+    uint32_t addr;          // IPv4 address in network byte order, 0 for local clients
+    int connections;        // open connections, 0 if the slot is free
+    int transfers;          // admitted transfers
+    long in_flight;         // bytes the admitted transfers may send
+};
+static struct peer peers[1024]; /* at most one per connection */
+static struct peer everyone; /* the totals over all clients */
+static long next_queued = 1; /* the place in the queue of the next transfer */
+static int num_queued; /* transfers waiting for admission */
+static int num_withheld; /* admitted transfers with window updates held back */
+
+/*
+ * The state of a client connection: the frame that is being read, and its
+ * streams. Frames are read piece by piece as data arrives, so a slow
+ * client never blocks the others.
+ */
+struct connection {
+    int state;              // AWAITING_HEADER or AWAITING_PAYLOAD
+    uint32_t received;      // bytes of the header or payload read so far
+    char header[FRAME_HEADER_SIZE];
+    struct frame_header frame;
+    char payload[MAX_FRAME_DATA];
+    struct server_stream streams[MAX_STREAMS + 1];
+    int local;              // a Unix domain socket, which can pass files
+    int passed_fds[MAX_STREAMS]; // files passed along with FRAME_FD frames
+    int num_passed_fds;
+    struct peer *peer;      // the client, by address
+    long stream_window;     // the window each transfer starts with, see mux.h
+    int num_admitted;       // streams with admitted transfers
+    int num_queued;         // streams with transfers waiting for admission
+};
+
+/*
+ * This function takes a file descriptor fd, a stream and a int
+ * representing message as inputs, then it converts the message into
+ * network byte order and sends a response to the client on that stream.
+ */
+void respond(int fd, int stream, int message) {
+    D("RESPONSE [%d]: %d\n", stream, message);
+    if (write_frame_int(fd, stream, FRAME_RESPONSE, message) == -1) {
+        perror("server: write");
+    }
+}
+
+/*
+ * Group commit (DURABILITY_GROUP): a response that acknowledges a change
+ * to the dest tree waits until GROUP_COMMIT_FILES of them have piled up,
+ * the server has nothing left to read, or the oldest has waited
+ * GROUP_COMMIT_MS, and then one syncfs() makes all of their files durable
+ * at once. Each stream has at most one request outstanding, so holding
+ * back its response never reorders anything.
+ *
+ * Responses on the metadata stream (new directories, deduplicated and
+ * moved files) are not held back: the client has only one request on it
+ * outstanding, so it would wait for every group commit in turn. Their
+ * changes are synced one by one instead, as with DURABILITY_FILE, before
+ * they are acknowledged.
+ */
+#define GROUP_COMMIT_FILES 256
+#define GROUP_COMMIT_MS 10
+
+struct deferred_response {
+    int fd;                 // the client connection
+    int stream;
+};
+static struct deferred_response deferred[GROUP_COMMIT_FILES];
+static int num_deferred;
+static struct timespec first_deferred; /* when the oldest was deferred */
+static int changed; /* the current frame changed the dest tree */
+static int sync_now; /* the current frame's response can't wait for a group commit */
+
+/*
+ * This function takes a path as input and fsyncs it. The path may already
+ * have the client's permission, which the server (unless it runs as root)
+ * may not be able to open with, e.g. a file of mode 0200 or 0000, or a
+ * directory of mode 0300. Such a path is synced with the whole file
+ * system instead. If it succeeds return 0, otherwise return -1.
+ */
+static int fsync_path(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1 && errno == EACCES) {
+        fd = open(path, O_WRONLY);
+    }
+    if (fd == -1 && (errno == EACCES || errno == EISDIR)) {
+        fd = open(".", O_RDONLY | O_DIRECTORY);
+        if (fd == -1 || syncfs(fd) == -1) {
+            perror("server: syncfs");
+            if (fd != -1) {
+                close(fd);
+            }
+            return -1;
+        }
+        close(fd);
+        return 0;
+    }
+    if (fd == -1 || fsync(fd) == -1) {
+        perror("server: fsync");
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/*
+ * This function takes the path of a file or directory that the server has
+ * just created or written, and an open descriptor fd of it (or -1) as
+ * inputs, and makes the change durable as server_options.durability asks:
+ * at once (DURABILITY_FILE, and DURABILITY_GROUP on the metadata stream),
+ * by the next group commit (DURABILITY_GROUP), or not at all. New names
+ * are only durable once their directory is, so that is synced as well.
+ * If it succeeds return 0, otherwise return -1.
+ */
+static int make_durable(const char *path, int fd) {
+    if (server_options.durability == DURABILITY_GROUP && !sync_now) {
+        changed = 1;
+        return 0;
+    }
+    if (server_options.durability == DURABILITY_NONE) {
+        return 0;
+    }
+    if (fd != -1 ? fsync(fd) == -1 : fsync_path(path) == -1) {
+        if (fd != -1) {
+            perror("server: fsync");
+        }
+        return -1;
+    }
+    char *parent = strdup(path);
+    int result = fsync_path(dirname(parent));
+    free(parent);
+    return result;
+}
+
+/*
+ * This function syncs the file system of the dest tree, and then sends
+ * every deferred response (ERROR instead of OK if the sync failed).
+ */
+static void commit_group(void) {
+    if (num_deferred == 0) {
+        return;
+    }
+    int result = OK;
+    int fd = open(".", O_RDONLY | O_DIRECTORY);
+    if (fd == -1 || syncfs(fd) == -1) {
+        perror("server: syncfs");
+        result = ERROR;
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    D("GROUP COMMIT: %d\n", num_deferred);
+    for (int i = 0; i < num_deferred; i++) {
+        respond(deferred[i].fd, deferred[i].stream, result);
+    }
+    num_deferred = 0;
+}
+
+/*
+ * This function takes the file descriptor fd of a client connection and a
+ * stream as inputs, and holds back the OK response on that stream until
+ * the next group commit, which happens at once if the group is full.
+ */
+static void defer_response(int fd, int stream) {
+    if (num_deferred == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &first_deferred);
+    }
+    deferred[num_deferred].fd = fd;
+    deferred[num_deferred].stream = stream;
+    if (++num_deferred == GROUP_COMMIT_FILES) {
+        commit_group();
+    }
+}
+
+/*
+ * This function returns how many milliseconds are left until the next
+ * group commit is due, 0 if it is due now, or -1 if there is nothing to
+ * commit.
+ */
+static long group_commit_due(void) {
+    if (num_deferred == 0) {
+        return -1;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long waited = (now.tv_sec - first_deferred.tv_sec) * 1000 +
+                  (now.tv_nsec - first_deferred.tv_nsec) / 1000000;
+    return waited >= GROUP_COMMIT_MS ? 0 : GROUP_COMMIT_MS - waited;
+}
+
+/*
+ * This function takes the file descriptor fd of a client connection that
+ * is being closed as input, and drops its deferred responses, so that
+ * they don't go to a later connection that gets the same descriptor.
+ */
+static void forget_deferred(int fd) {
+    int kept = 0;
+    for (int i = 0; i < num_deferred; i++) {
+        if (deferred[i].fd != fd) {
+            deferred[kept++] = deferred[i];
+        }
+    }
+    num_deferred = kept;
+}
+
+/*
+ * This function takes the address of a client (0 for a local one) as
+ * input, and returns its peer, which starts out empty if the client has no
+ * other connection. The caller counts the new connection.
+ */
+static struct peer *find_peer(uint32_t addr) {
+    struct peer *free_slot = NULL;
+    for (int i = 0; i < 1024; i++) {
+        if (peers[i].connections > 0 && peers[i].addr == addr) {
+            return &peers[i];
+        }
+        if (peers[i].connections == 0 && free_slot == NULL) {
+            free_slot = &peers[i];
+        }
+    }
+    memset(free_slot, 0, sizeof(struct peer));
+    free_slot->addr = addr;
+    return free_slot;
+}
+
+/*
+ * This function takes a peer p and a number of bytes as inputs, and
+ * returns 1 if p and all clients together may have that many more bytes
+ * in flight, and 0 otherwise. Anything goes while nothing is in flight,
+ * so that a limit below a window can't stop everything.
+ */
+static int within_limits(const struct peer *p, long bytes) {
+    return (p->in_flight == 0 || p->in_flight + bytes <= server_options.client_in_flight) &&
+           (everyone.in_flight == 0 || everyone.in_flight + bytes <= server_options.max_in_flight);
+}
+
+/*
+ * This function takes a peer p and the bytes a transfer may send at first
+ * as inputs, and returns 1 if p may start the transfer, and 0 otherwise.
+ */
+static int can_admit(const struct peer *p, long bytes) {
+    return p->transfers < server_options.client_transfers &&
+           everyone.transfers < server_options.max_transfers && within_limits(p, bytes);
+}
+
+/*
+ * This function takes a connection conn and one of its streams st whose
+ * transfer has been queued as inputs, and lets the transfer count.
+ */
+static void admit(struct connection *conn, struct server_stream *st) {
+    st->queued = 0;
+    num_queued--;
+    conn->num_queued--;
+    st->admitted = 1;
+    conn->num_admitted++;
+    conn->peer->transfers++;
+    everyone.transfers++;
+    conn->peer->in_flight += st->credit;
+    everyone.in_flight += st->credit;
+    if (st->withheld > 0) {
+        num_withheld++;
+    }
+}
+
+/*
+ * This function takes a connection conn and one of its streams st that
+ * has just started to receive a file as inputs, and admits the transfer,
+ * or queues it if it is over the limits or others are waiting already.
+ * Until the first window update, the client may send a whole window.
+ */
+static void request_admission(struct connection *conn, struct server_stream *st) {
+    st->credit = (st->data_left < conn->stream_window) ? st->data_left : conn->stream_window;
+    st->withheld = 0;
+    st->queued = next_queued++;
+    num_queued++;
+    conn->num_queued++;
+    if (num_queued == 1 && can_admit(conn->peer, st->credit)) {
+        admit(conn, st);
+    }
+}
+
+/*
+ * This function takes a connection conn and one of its streams st whose
+ * transfer has ended (or never started) as inputs, and stops counting it.
+ */
+static void end_admission(struct connection *conn, struct server_stream *st) {
+    // The file isn't written to any more, whether it is complete or not.
+    close_received_file(st);
+    if (st->admitted) {
+        conn->num_admitted--;
+        conn->peer->transfers--;
+        everyone.transfers--;
+        conn->peer->in_flight -= st->credit;
+        everyone.in_flight -= st->credit;
+        if (st->withheld > 0) {
+            num_withheld--;
+        }
+    } else if (st->queued) {
+        num_queued--;
+        conn->num_queued--;
+    }
+    st->admitted = 0;
+    st->queued = 0;
+    st->credit = 0;
+    st->withheld = 0;
+}
+
+/*
+ * This function takes a connection conn, one of its streams st and the
+ * bytes of data that have arrived on it as inputs, and takes them off
+ * what is in flight.
+ */
+static void use_credit(struct connection *conn, struct server_stream *st, long bytes) {
+    if (bytes > st->credit) {
+        bytes = st->credit;
+    }
+    st->credit -= bytes;
+    if (st->admitted) {
+        conn->peer->in_flight -= bytes;
+        everyone.in_flight -= bytes;
+    }
+}
+
+/*
+ * This function takes the file descriptor fd of a client connection conn,
+ * one of its streams st and its number, and the bytes of data that have
+ * just been written to disk as inputs, and lets the client send as many
+ * more with a window update, plus any that were held back before. The
+ * update is held back (again) if the transfer is queued or the limits on
+ * bytes in flight are reached. More than the rest of the file is never
+ * handed out.
+ */
+static void grant_window(int fd, struct connection *conn, struct server_stream *st,
+                         int stream, long bytes) {
+    int was_withheld = st->admitted && st->withheld > 0;
+    st->withheld += bytes;
+    long needed = st->data_left - st->credit;
+    if (st->withheld > needed) {
+        st->withheld = (needed > 0) ? needed : 0;
+    }
+    if (st->admitted && st->withheld > 0 && within_limits(conn->peer, st->withheld)) {
+        if (write_frame_int(fd, stream, FRAME_WINDOW, st->withheld) == -1) {
+            perror("server: write");
+        }
+        st->credit += st->withheld;
+        conn->peer->in_flight += st->withheld;
+        everyone.in_flight += st->withheld;
+        st->withheld = 0;
+    }
+    num_withheld += (st->admitted && st->withheld > 0) - was_withheld;
+}
+
+/*
+ * This function takes the array of client connections and the largest
+ * file descriptor in use as inputs, and admits queued transfers, oldest
+ * first, as far as the limits allow, and then sends the window updates
+ * that were held back, starting at another connection each time.
+ */
+static void admit_waiting(struct connection **connections, int max_fd) {
+    while (num_queued > 0) {
+        struct connection *oldest_conn = NULL;
+        struct server_stream *oldest = NULL;
+        for (int fd = 0; fd <= max_fd; fd++) {
+            struct connection *conn = connections[fd];
+            if (conn == NULL || conn->num_queued == 0) {
+                continue;
+            }
+            for (int s = 1; s <= MAX_STREAMS; s++) {
+                struct server_stream *st = &conn->streams[s];
+                if (st->queued && (oldest == NULL || st->queued < oldest->queued) &&
+                    can_admit(conn->peer, st->credit)) {
+                    oldest_conn = conn;
+                    oldest = st;
+                }
+            }
+        }
+        if (oldest == NULL) {
+            break;
+        }
+        admit(oldest_conn, oldest);
+    }
+
+    static int next_fd;
+    for (int i = 0; i <= max_fd && num_withheld > 0; i++) {
+        int fd = (next_fd + i) % (max_fd + 1);
+        struct connection *conn = connections[fd];
+        if (conn == NULL || conn->num_admitted == 0) {
+            continue;
+        }
+        for (int s = 1; s <= MAX_STREAMS; s++) {
+            if (conn->streams[s].admitted && conn->streams[s].withheld > 0) {
+                grant_window(fd, conn, &conn->streams[s], s, 0);
+            }
+        }
+    }
+    next_fd = (next_fd + 1) % (max_fd + 1);
+}
+
+/*
+ * This function takes a client connection conn as input, and returns 1 if
+ * it must not be read until one of its transfers is admitted, and 0
+ * otherwise.
+ */
+static int is_paused(const struct connection *conn) {
+    return conn->num_queued > 0 && conn->num_admitted == 0;
+}
+
+/*
+ * This function takes an open file src_fd and a copy of it dest_fd as
+ * inputs, and punches the holes of src_fd into dest_fd, since a plain copy
+ * writes out their zeros. Holes are an optimization only, so failures
+ * (e.g. a file system without fallocate()) are ignored.
+ */
+static void punch_holes(int src_fd, int dest_fd) {
+    struct stat stat_src;
+    if (fstat(src_fd, &stat_src) == -1 || stat_src.st_blocks * 512 >= stat_src.st_size) {
+        return; // not sparse
+    }
+    off_t hole = 0;
+    while ((hole = lseek(src_fd, hole, SEEK_HOLE)) != -1 && hole < stat_src.st_size) {
+        off_t data = lseek(src_fd, hole, SEEK_DATA);
+        if (data == -1) {
+            data = stat_src.st_size;
+        }
+        if (fallocate(dest_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, hole, data - hole) == -1) {
+            return;
+        }
+        hole = data;
+    }
+}
+
+/*
+ * This function takes an open file src_fd, an empty file dest_fd open for
+ * writing and a length as inputs, and makes dest_fd's file a copy of the
+ * first length bytes of src_fd's file (less if src_fd's file is shorter).
+ * The copy shares blocks with the source where the file system supports
+ * it (reflink), otherwise copy_file_range() keeps the data inside the
+ * kernel, and holes are punched back in. The copy doesn't depend on
+ * src_fd's file offset, which may be shared with a client.
+ * If it succeeds return 0, otherwise return 1.
+ */
+int copy_fd(int src_fd, int dest_fd, off_t length) {
+    int copied = 0, cloned = 0;
+#ifdef FICLONE
+    // A clone takes the whole file, which may have grown since.
+    if (ioctl(dest_fd, FICLONE, src_fd) == 0) {
+        struct stat stat_dest;
+        copied = cloned = (fstat(dest_fd, &stat_dest) == 0 &&
+            (stat_dest.st_size <= length || ftruncate(dest_fd, length) == 0));
+    }
+#endif
+    if (!copied) {
+        loff_t in = 0, out = 0;
+        ssize_t n = 0;
+        while (in < length && (n = copy_file_range(src_fd, &in, dest_fd, &out, length - in, 0)) > 0);
+        copied = (n != -1);
+    }
+    if (!copied) {
+        // Not supported between these file systems: copy through user space.
+        char buffer[MAXDATA * 64];
+        ssize_t n = 0;
+        off_t offset = 0;
+        if (ftruncate(dest_fd, 0) == 0) {
+            while (offset < length &&
+                   (n = pread(src_fd, buffer, length - offset < (off_t)sizeof(buffer) ?
+                              length - offset : (off_t)sizeof(buffer), offset)) > 0) {
+                if (pwrite(dest_fd, buffer, n, offset) != n) {
+                    n = -1;
+                    break;
+                }
+                offset += n;
+            }
+            copied = (n != -1);
+        }
+    }
+    if (!copied) {
+        perror("server: copy");
+        return 1;
+    }
+    if (!cloned) {
+        punch_holes(src_fd, dest_fd);
+    }
+    return 0;
+}
+
+/*
+ * This function takes a path src and a path dest that does not exist yet
+ * as inputs, and makes dest a copy of src, as copy_fd() does. The copy is
+ * only readable and writable by the server, until the caller gives it its
+ * permission. If it succeeds return the copy, open for writing, otherwise
+ * return -1.
+ */
+int copy_local_file(const char *src, const char *dest) {
+    int src_fd = open(src, O_RDONLY);
+    if (src_fd == -1) {
+        perror("server: open");
+        return -1;
+    }
+    struct stat stat_src;
+    if (fstat(src_fd, &stat_src) == -1) {
+        perror("server: fstat");
+        close(src_fd);
+        return -1;
+    }
+    int dest_fd = open(dest, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (dest_fd == -1) {
+        perror("server: open");
+        close(src_fd);
+        return -1;
+    }
+    int result = copy_fd(src_fd, dest_fd, stat_src.st_size);
+    close(src_fd);
+    if (result != 0) {
+        close(dest_fd);
+        unlink(dest);
+        return -1;
+    }
+    return dest_fd;
+}
+
+/*
+ * This function takes a request struct req for a regular file as input,
+ * and returns 1 if it carries the file's hash, or 0 if it doesn't (a
+ * stat-only request for a file the client hasn't hashed).
+ */
+static int has_hash(const struct request *req) {
+    char zero[HASH_SIZE] = {0};
+    return memcmp(req->hash, zero, HASH_SIZE) != 0;
+}
+
+/*
+ * This function takes a path the server has written and the request
+ * struct req it was written for as inputs, and gives the file the mtime it
+ * has on the client, so that stat-only requests can find it unchanged.
+ * If it succeeds (or the client sent no mtime) return 0, otherwise -1.
+ */
+static int preserve_mtime(const char *path, const struct request *req) {
+    if (req->mtime == NO_MTIME) {
+        return 0;
+    }
+    // Round down, so that an mtime before the epoch has 0 <= tv_nsec.
+    time_t sec = req->mtime / 1000000000;
+    long nsec = req->mtime % 1000000000;
+    if (nsec < 0) {
+        sec--;
+        nsec += 1000000000;
+    }
+    struct timespec times[2] = {
+        {0, UTIME_OMIT},
+        {sec, nsec}
+    };
+    if (utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW) == -1) {
+        perror("server: utimensat");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * This function takes the content index ci, the tree index ti and a request
+ * struct req for a regular file as inputs. If the content of that file is already stored on
+ * the server under another path, it is copied into req->path so that the
+ * client doesn't have to send it, and 0 is returned. Otherwise return 1.
+ */
+int dedup_file(struct content_index *ci, struct tree_index *ti, struct request *req) {
+    const char *found = content_index_find(ci, req->hash, req->size);
+    if (found == NULL || strcmp(found, req->path) == 0) {
+        return 1;
+    }
+    char *src = strdup(found);
+
+    // Replace whatever is in the way; the client would overwrite it anyway.
+    struct stat stat_file;
+    if (lstat(req->path, &stat_file) == 0) {
+        if (remove(req->path) == -1) {
+            perror("server: remove");
+            free(src);
+            return 1;
+        }
+        tree_index_remove(ti, req->path);
+    }
+    int dest_fd = copy_local_file(src, req->path);
+    if (dest_fd == -1) {
+        free(src);
+        return 1;
+    }
+
+    // The indexed file might have been changed behind our back, so the
+    // copy must be verified just like a file received from the network.
+    char blank[BLOCKSIZE];
+    FILE *f = fopen(req->path, "rb");
+    if (f == NULL || check_hash(req->hash, hash(blank, f)) != 0) {
+        if (f != NULL) {
+            fclose(f);
+        }
+        fprintf(stderr, "STALE CONTENT INDEX ENTRY: %s\n", src);
+        content_index_remove(ci, req->hash, req->size);
+        close(dest_fd);
+        unlink(req->path);
+        free(src);
+        return 1;
+    }
+    fclose(f);
+    // Sync through the descriptor, which still works once the copy has
+    // the client's permission.
+    if (fchmod(dest_fd, req->mode & 0777) == -1) {
+        perror("server: fchmod");
+    }
+    preserve_mtime(req->path, req);
+    if (lstat(req->path, &stat_file) == 0) {
+        tree_index_set_hash(tree_index_update(ti, req->path, &stat_file), req->hash);
+    }
+    int durable = make_durable(req->path, dest_fd);
+    if (close(dest_fd) == -1) {
+        perror("server: close");
+        durable = -1;
+    }
+    if (durable == -1) {
+        free(src);
+        return 1;
+    }
+    printf("%s (deduplicated from %s)\n", req->path, src);
+    free(src);
+    return 0;
+}
+
+/*
+ * This function takes the content index ci, the tree index ti, a request
+ * struct req for a regular file and the path origin the client sent that
+ * file under before it was moved as inputs. If origin still holds the
+ * announced content, it is renamed to req->path, which costs neither a
+ * copy nor a transfer and doesn't leave the old copy behind, and 0 is
+ * returned. Otherwise (e.g. the file was changed as well) return 1.
+ */
+static int move_file(struct content_index *ci, struct tree_index *ti,
+                     struct request *req, const char *origin) {
+    struct tree_entry *e = tree_index_find(ti, origin);
+    if (e == NULL || !S_ISREG(e->mode) || e->size != req->size ||
+        strcmp(origin, req->path) == 0) {
+        return 1;
+    }
+    if (!(e->flags & HASH_VALID) && has_hash(req)) {
+        FILE *f = fopen(origin, "rb");
+        if (f == NULL) {
+            return 1;
+        }
+        char blank[BLOCKSIZE];
+        tree_index_set_hash(e, hash(blank, f));
+        fclose(f);
+    }
+    // Without a hash, the mtime (which rename keeps) has to do.
+    if (has_hash(req) ? memcmp(e->hash, req->hash, HASH_SIZE) != 0 : e->mtime != req->mtime) {
+        return 1;
+    }
+    // The content index may point to origin, so it has to follow the
+    // file, whether or not the client has hashed it.
+    char content_hash[HASH_SIZE];
+    int hash_known = (e->flags & HASH_VALID) != 0;
+    memcpy(content_hash, e->hash, HASH_SIZE);
+
+    // A file in the way is replaced, as the client would overwrite it anyway.
+    struct stat stat_file;
+    if (lstat(req->path, &stat_file) == 0 && S_ISDIR(stat_file.st_mode)) {
+        return 1;
+    }
+    if (rename(origin, req->path) == -1) {
+        perror("server: rename");
+        return 1;
+    }
+    tree_index_remove(ti, origin);
+    if (chmod(req->path, req->mode & 0777) == -1) {
+        perror("server: chmod");
+    }
+    preserve_mtime(req->path, req);
+    if (hash_known) {
+        content_index_add(ci, content_hash, req->size, req->path);
+    }
+    if (lstat(req->path, &stat_file) == 0) {
+        struct tree_entry *moved = tree_index_update(ti, req->path, &stat_file);
+        if (hash_known) {
+            tree_index_set_hash(moved, content_hash);
+        }
+    }
+    if (make_durable(req->path, -1) == -1) {
+        return 1;
+    }
+    printf("%s (moved from %s)\n", req->path, origin);
+    return 0;
 }
 
 /*
- * This function takes string of source path and a string of host or
- * a unsigned short of port to intialize a client to synchronize files
- * with a server.
+ * This function takes the content index ci, the tree index ti, a request
+ * struct req for a regular file that the server doesn't have, and the
+ * path origin it was moved from (NULL if it wasn't) as inputs, and tries
+ * to make req->path from a file the server already has. It returns the
+ * response for the client: OK if that worked, otherwise SENDFILE.
  */
-char *str_parent; /* initialize a static string to store basename of source */
-
-int rcopy_client(char *source, char *host, unsigned short port) {
-    static int i = 0; /* counter of numbers of iteration */
-    int num_child_process = 0; /* total number of child processes */
-    int neg_flag = 0; /* error indicator */
-
-    // Check if the file exits.
-    struct stat stat_src;
-    if (lstat(source, &stat_src) == -1) {
-        perror("client: lstat");
-        exit(1);
+static int reuse_file(struct content_index *ci, struct tree_index *ti,
+                      struct request *req, const char *origin) {
+    if (origin != NULL && move_file(ci, ti, req, origin) == 0) {
+        return OK;
     }
+    if (!has_hash(req)) {
+        return SENDFILE;
+    }
+    return dedup_file(ci, ti, req) == 0 ? OK : SENDFILE;
+}
 
-    // Get absolute path.
-    char abs_src[MAXPATH];
-    realpath(source, abs_src);
-
-    // Intialize components for socket connection.
-    static int sock_fd;
-    struct sockaddr_in server;
-    struct hostent *hp;
-
-    // First, set up socket connection.
-    // Note: only establish once at 1st iteration.
-    if (i == 0) {
-        // Set up basename of source.
-        str_parent = malloc(MAXPATH);
-        strcpy(str_parent, basename(abs_src));
-
-        // Get hostname.
-        if ((hp = gethostbyname(host)) == NULL) {
-            perror("client: gethostbyname");
-            exit(1);
+/*
+ * This function takes the tree index tree, the content index content and a
+ * REGFILE or REGDIR request struct ser_rec (type and size in host order),
+ * and the path a moved file was sent under before (or NULL) origin as
+ * inputs, and compares the file or directory with the dest tree. It returns
+ * the response for the client: OK, SENDFILE, ERROR or SKIPDIR.
+ */
+static int answer_request(struct tree_index *tree, struct content_index *content,
+                          struct request *ser_rec, const char *origin) {
+    if (ser_rec->type == REGFILE || ser_rec->type == STATFILE) {
+        // Look the file up in the index rather than on disk.
+        struct tree_entry *e = tree_index_find(tree, ser_rec->path);
+        if (e == NULL) { // If the file doesn't exist.
+            return reuse_file(content, tree, ser_rec, origin);
         }
-
-        // Get file discriptor of socket.
-        if ((sock_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-            perror("client: socket");
-            exit(1);
+        // If this is not a file, this means there is a mismatch.
+        if (!S_ISREG(e->mode)) {
+            fprintf(stderr, "NOT A FILE: %s\n", ser_rec->path);
+            // Mismatch, try to change the permission.
+            if (chmod(ser_rec->path, (ser_rec->mode) & 0777) == -1) {
+                perror("server: chmod");
+            }
+            return ERROR;
         }
-
-        // Set the IP and port of the server to connect to.
-        server.sin_family = AF_INET;
-        server.sin_port = htons(port);
-        server.sin_addr = *((struct in_addr *)hp->h_addr);
-
-        // Connect to the server.
-        if (connect(sock_fd, (struct sockaddr *)&server, sizeof(server)) == -1) {
-            perror("client: connect");
-            close(sock_fd);
-            exit(1);
+        // If there is no mismatch.
+        // First check if their sizes are different.
+        if (ser_rec->size != e->size) {
+            // If sizes are different, send a SENDFILE message
+            // to the client, unless we already have the content.
+            return reuse_file(content, tree, ser_rec, origin);
+        }
+        // In stat-only mode, the same size and mtime mean the same
+        // content, and without a hash there is nothing else to go by.
+        int unchanged = (ser_rec->type == STATFILE && ser_rec->mtime == e->mtime);
+        if (!unchanged && !has_hash(ser_rec)) {
+            return reuse_file(content, tree, ser_rec, origin);
+        }
+        // If sizes are the same, we check hash and permission.
+        // The startup scan has hashed every file, so a hash is
+        // only missing here if the file couldn't be read then.
+        if (!unchanged && !(e->flags & HASH_VALID)) {
+            FILE *f = fopen(ser_rec->path, "rb");
+            if (f == NULL) {
+                perror("server: fopen");
+                fprintf(stderr, "ERROR: %s\n", ser_rec->path);
+                return ERROR;
+            }
+            char blank[BLOCKSIZE];
+            tree_index_set_hash(e, hash(blank, f));
+            if (fclose(f) == EOF) {
+                perror("server: fclose");
+                return ERROR;
+            }
+        }
+        if (!unchanged && check_hash(ser_rec->hash, e->hash) != 0) {
+            // If hash is different, then copy the file.
+            return reuse_file(content, tree, ser_rec, origin);
+        }
+        // If hash is same, then check permission.
+        if ((e->mode & 0777) != ((ser_rec->mode) & 0777)) {
+            if (chmod(ser_rec->path, (ser_rec->mode) & 0777) == -1) {
+                perror("server: chmod");
+                return ERROR;
+            }
+            tree_index_set_mode(tree, e, ser_rec->mode);
+        }
+        // The content is the same, so take over the client's mtime for
+        // the stat-only syncs to come.
+        if (!unchanged && ser_rec->mtime != NO_MTIME && e->mtime != ser_rec->mtime) {
+            struct stat stat_file;
+            if (preserve_mtime(ser_rec->path, ser_rec) == 0 && lstat(ser_rec->path, &stat_file) == 0) {
+                tree_index_set_hash(tree_index_update(tree, ser_rec->path, &stat_file), ser_rec->hash);
+            }
+        }
+        if (has_hash(ser_rec)) {
+            content_index_add(content, ser_rec->hash, ser_rec->size, ser_rec->path);
+        }
+        return OK;
+
+    // If the struct that we received is a directory.
+    } else if (ser_rec->type == REGDIR) {
+        printf("%s\n", ser_rec->path);
+        struct tree_entry *e = tree_index_find(tree, ser_rec->path);
+        if (e == NULL) { // If the directory doesn't exist.
+            // Make a directory, and properly set its permission.
+            if (mkdir(ser_rec->path, 0777) == -1 && errno != EEXIST) {
+                perror("server: mkdir");
+                return ERROR;
+            }
+            // Something unknown to the index may have been in
+            // the way, so look at what is there now.
+            struct stat stat_dir;
+            if (lstat(ser_rec->path, &stat_dir) == -1) {
+                perror("server: lstat");
+                return ERROR;
+            }
+            e = tree_index_update(tree, ser_rec->path, &stat_dir);
+            if (make_durable(ser_rec->path, -1) == -1) {
+                return ERROR;
+            }
+        }
+        // Check the permission.
+        if ((e->mode & 0777) != ((ser_rec->mode) & 0777)) {
+            if (chmod(ser_rec->path, (ser_rec->mode) & 0777) == -1) {
+                perror("server: chmod");
+                return ERROR;
+            }
+            tree_index_set_mode(tree, e, ser_rec->mode);
+        }
+        if (S_ISDIR(e->mode)) {
+            // If the client's summary of the subtree matches
+            // ours, there is nothing below it to look at.
+            char zero[HASH_SIZE] = {0};
+            if (memcmp(ser_rec->hash, zero, HASH_SIZE) != 0 &&
+                tree_index_digest(tree, e) == 0 &&
+                memcmp(ser_rec->hash, e->hash, HASH_SIZE) == 0) {
+                return SKIPDIR;
+            }
+            return OK;
+        } else {
+            // If it's not a directory, then there is a mismatch.
+            fprintf(stderr, "NOT A DIR: %s\n", ser_rec->path);
+            return ERROR;
         }
-        printf("Socket connection established.\n");
     }
+    // Can't happen.
+    return ERROR;
+}
 
-    // Next, construct request struct.
-    struct request req_src;
-
-    // Ignore LINKS.
-    if (S_ISLNK(stat_src.st_mode)) {
-        return 0;
-
-    // Construct fields of request struct for REGULAR FILE.
-    } else if (S_ISREG(stat_src.st_mode)) {
-        req_src.type = htonl(REGFILE); /* Type */
-        strcpy(req_src.path, strstr(source, str_parent)); /* Path */
-        req_src.mode = stat_src.st_mode; /* Mode */
-        char blank[BLOCKSIZE]; /* Hash */
-        char *hash_val;
-        FILE *f = fopen(source, "rb");
+/*
+ * This function takes the tree index tree and a stream st that has just
+ * received its TRANSFILE request as inputs, and prepares the file for the
+ * data that follows on the stream. It returns the response for the client,
+ * or -1 if the response has to wait until all of the data has arrived.
+ */
+static int start_receiving(struct tree_index *tree, struct server_stream *st) {
+    struct request *ser_rec = &st->req;
+    struct stat stat_file;
+    if (lstat(ser_rec->path, &stat_file) == 0) {
+        // If the file exits, we remove the file first.
+        if (remove(ser_rec->path) == -1) {
+            perror("server: remove");
+            return ERROR;
+        }
+    }
+    tree_index_remove(tree, ser_rec->path);
+
+    // If the file doesn't exist.
+    // There is an exceptional case where the file size is 0.
+    // This means that there is no data to be transferred.
+    if (ser_rec->size == 0) {
+        // Create an empty file.
+        int empty_fd = open(ser_rec->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (empty_fd == -1) {
+            perror("server: open");
+            return ERROR;
+        }
+        // Index its hash while the file can still be read; the client's
+        // permission may not let the server read it later.
+        char empty_hash[BLOCKSIZE];
+        FILE *f = fopen(ser_rec->path, "rb");
         if (f == NULL) {
-            if (errno == EACCES) {
-                // try to upload a non-readable file
-                perror("client: fopen");
-                fprintf(stderr, "ERROR: %s\n", req_src.path);
-                return 1;
-            } else {
-                perror("client: fopen");
-                exit(1);
-            }
+            perror("server: fopen");
+            close(empty_fd);
+            return ERROR;
         }
-        // Compute hash of source file.
-        hash_val = hash(blank, f);
-        for (int i = 0; i < 8; i++) {
-            req_src.hash[i] = hash_val[i];
+        hash(empty_hash, f);
+        fclose(f);
+        if (fchmod(empty_fd, (ser_rec->mode) & 0777) == -1) {
+            fprintf(stderr, "ERROR while changing empty file's permission: \n%s\n", ser_rec->path);
+            close(empty_fd);
+            return ERROR;
         }
-        if (fclose(f) == EOF) {
-            perror("client: fopen");
-            exit(1);
+        preserve_mtime(ser_rec->path, ser_rec);
+        if (lstat(ser_rec->path, &stat_file) == 0) {
+            tree_index_set_hash(tree_index_update(tree, ser_rec->path, &stat_file), empty_hash);
         }
-        req_src.size = htonl(stat_src.st_size); /* Size */
-
-    // Construct fields of request struct for DIRECTORY
-    } else if (S_ISDIR(stat_src.st_mode)) {
-        req_src.type = htonl(REGDIR); /* Type */
-
-        char abs_path[MAXPATH]; /* Path */
-        realpath(source, abs_path);
-        strcpy(req_src.path, strstr(abs_path, str_parent));
+        int durable = make_durable(ser_rec->path, empty_fd);
+        if (close(empty_fd) == -1) {
+            perror("server: close");
+            return ERROR;
+        }
+        return durable == 0 ? OK : ERROR;
+    }
+    // The file stays open until all of its data has arrived.
+    st->fd = open(ser_rec->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (st->fd == -1) {
+        // A file under a non-writable dir.
+        perror("server: open");
+        fprintf(stderr, "ERROR: %s\n", ser_rec->path);
+        return ERROR;
+    }
+    // No reply required.
+    st->offset = 0;
+    st->data_left = ser_rec->size;
+    st->state = AWAITING_DATA;
+    return -1;
+}
 
-        req_src.mode = stat_src.st_mode; /* Mode */
 
-        /*
-         * Hash
-         * hash of a dir should be NULL, but NULL content cannot be pass
-         * through socket. To make it work desirely, we make them all \0.
-         */
-        for(int i = 0; i < 8; i++) {
-            req_src.hash[i] = '\0';
-        }
-        req_src.size = htonl(stat_src.st_size); /* Size */
+/*
+ * This function takes the tree index tree, the content index content and a
+ * stream st whose file has been received completely as inputs, and checks
+ * the file against the request before giving it its permission and adding
+ * it to the indexes. It returns the response for the client.
+ */
+static int finish_receiving(struct tree_index *tree, struct content_index *content,
+                            struct server_stream *st) {
+    struct request *ser_rec = &st->req;
+    printf("File transfer is completed!\n");
+    struct stat stat_file_received;
+    // Get the info of the file received.
+    if (lstat(ser_rec->path, &stat_file_received) == -1) {
+        perror("server: lstat");
+        return ERROR;
+    }
 
-    } else {
-        // shouldn't get here.
-        fprintf(stderr, "File type error!\n");
-        exit(1);
+    // First check if their sizes are different.
+    if (ser_rec->size != stat_file_received.st_size) {
+        // If sizes are different, we report the error.
+        fprintf(stderr, "ERROR! File received is different from the original file.\n");
+        fprintf(stderr, "ERROR: %s\n", ser_rec->path);
+        return ERROR;
+    }
+    // If sizes are the same, we check hash and permission.
+    char blank[BLOCKSIZE];
+    FILE *fm = fopen(ser_rec->path, "rb");
+    if (fm == NULL) {
+        perror("server: fopen");
+        return ERROR;
+    }
+    // Calculate hash.
+    char *hash_dest = hash(blank, fm);
+    if (fclose(fm) == EOF) {
+        perror("server: fclose");
+        return ERROR;
+    }
+    if (check_hash(ser_rec->hash, hash_dest) != 0) {
+        // If hashes are different, we report the error.
+        fprintf(stderr, "ERROR! File received is different from the original file.\n");
+        fprintf(stderr, "ERROR: %s\n", ser_rec->path);
+        return ERROR;
     }
+    // If hash is same, then we change permission. The file is still
+    // open, so it can be synced whatever its permission is.
+    if (fchmod(st->fd, (ser_rec->mode) & 0777) == -1) {
+        fprintf(stderr, "ERROR WHILE CHANGING PERMISSION: %s\n", ser_rec->path);
+        return ERROR;
+    }
+    // Only acknowledge the file once it has its mtime and is as durable
+    // as asked for.
+    if (preserve_mtime(ser_rec->path, ser_rec) == -1 || make_durable(ser_rec->path, st->fd) == -1 ||
+        close_received_file(st) == -1) {
+        fprintf(stderr, "ERROR: %s\n", ser_rec->path);
+        return ERROR;
+    }
+    printf("%s\n", ser_rec->path);
+    // The mode and mtime have changed since the lstat() above.
+    if (lstat(ser_rec->path, &stat_file_received) == -1) {
+        perror("server: lstat");
+        return ERROR;
+    }
+    tree_index_set_hash(tree_index_update(tree, ser_rec->path, &stat_file_received), ser_rec->hash);
+    content_index_add(content, ser_rec->hash, ser_rec->size, ser_rec->path);
+    return OK;
+}
 
-    // Then upload every field of this struct one at a time to the server.
-    // The order is: type -> path -> mode -> hash -> size.
-    if (write(sock_fd, &(req_src.type), sizeof(int)) == -1) {
-        perror("client: write");
-        close(sock_fd);
-        exit(1);
+/*
+ * This function takes the tree index tree, the content index content, a
+ * stream st that is receiving a file, and the next bytes bytes of the file
+ * in data as inputs, and writes them to the file. If data is NULL, the
+ * next bytes bytes are a hole: nothing is written there, so the file stays
+ * sparse. An empty frame means that the client couldn't send the rest of
+ * the file. It returns the response for the client once the file is
+ * complete (or has failed), or -1 if more data is expected.
+ */
+static int receive_data(struct tree_index *tree, struct content_index *content,
+                        struct server_stream *st, const char *data, off_t bytes) {
+    struct request *ser_rec = &st->req;
+    if (bytes == 0) {
+        fprintf(stderr, "ERROR!! EARLY TERMINATION.\n");
+        fprintf(stderr, "ERROR: %s\n", ser_rec->path);
+        return ERROR;
     }
-    if (write(sock_fd, req_src.path, MAXPATH) == -1) {
-        perror("client: write");
-        close(sock_fd);
-        exit(1);
+    // If data left is less than 0, the file received should be
+    // different from the one sent from the client.
+    if (bytes > st->data_left) {
+        fprintf(stderr, "ERROR! File received is different from the original file.\n");
+        fprintf(stderr, "ERROR: %s\n", ser_rec->path);
+        return ERROR;
     }
-    if (write(sock_fd, &(req_src.mode), 4) == -1) {
-        perror("client: write");
-        close(sock_fd);
-        exit(1);
+
+    // Write the data to the file at its offset.
+    if (data != NULL && pwrite(st->fd, data, bytes, st->offset) != bytes) {
+        perror("server: write");
+        return ERROR;
     }
-    if (write(sock_fd, req_src.hash, BLOCKSIZE) == -1) {
-        perror("client: write");
-        close(sock_fd);
-        exit(1);
+    // Update the number of data left.
+    st->offset += bytes;
+    st->data_left -= bytes;
+    // A hole at the end only exists once the size covers it.
+    if (st->data_left == 0 && ftruncate(st->fd, st->offset) == -1) {
+        perror("server: ftruncate");
+        return ERROR;
     }
-    if (write(sock_fd, &(req_src.size), sizeof(int)) == -1) {
-        perror("client: write");
-        close(sock_fd);
-        exit(1);
+    if (st->data_left > 0) {
+        return -1;
     }
 
-    // After, wait for response from the server.
-    int tmp, rec_int;
-    if (read(sock_fd, &tmp, sizeof(int)) == -1) {
-        perror("client: read");
-        close(sock_fd);
-        exit(1);
+    // If data left is 0, i.e. file transfer is completed.
+    return finish_receiving(tree, content, st);
+}
+
+/*
+ * This function takes the tree index tree, the content index content, a
+ * stream st that is receiving a file, and the client's own open file src_fd
+ * (passed over a Unix domain socket) as inputs, and copies the file
+ * directly instead of receiving its data. The copy runs on the server's
+ * only thread, so src_fd must be a regular file of the announced size;
+ * anything else (e.g. /dev/zero) could keep it busy forever. It returns
+ * the response for the client.
+ */
+static int receive_fd(struct tree_index *tree, struct content_index *content,
+                      struct server_stream *st, int src_fd) {
+    struct stat stat_src;
+    if (fstat(src_fd, &stat_src) == -1) {
+        perror("server: fstat");
+        fprintf(stderr, "ERROR: %s\n", st->req.path);
+        return ERROR;
+    }
+    if (!S_ISREG(stat_src.st_mode) || stat_src.st_size != st->req.size) {
+        fprintf(stderr, "ERROR! File passed is different from the original file.\n");
+        fprintf(stderr, "ERROR: %s\n", st->req.path);
+        return ERROR;
     }
-    rec_int = ntohl(tmp);
+    if (copy_fd(src_fd, st->fd, st->req.size) != 0) {
+        fprintf(stderr, "ERROR: %s\n", st->req.path);
+        return ERROR;
+    }
+    return finish_receiving(tree, content, st);
+}
 
-    // if server responds ERROR: report error then terminate.
-    if (rec_int == ERROR) {
-        fprintf(stderr, "ERROR: %s\n", req_src.path);
-        return 1;
+/*
+ * This function takes the file descriptor fd of a client connection conn
+ * whose current frame has been read completely, the tree index tree and
+ * the content index content as inputs, and acts on the frame.
+ * If it succeeds return 0, or 1 if the client broke the protocol and the
+ * connection has to be closed.
+ */
+static int handle_frame(int fd, struct connection *conn,
+                        struct tree_index *tree, struct content_index *content) {
+    struct frame_header *h = &conn->frame;
+    struct server_stream *st = &conn->streams[h->stream];
+    int result;
+    changed = 0;
+    sync_now = (h->stream == METADATA_STREAM);
+
+    if (h->type == FRAME_REQUEST) {
+        // A moved file's request is followed by the path it had before.
+        char *origin = NULL;
+        if (h->length == REQUEST_SIZE + MAXPATH && h->stream == METADATA_STREAM) {
+            origin = conn->payload + REQUEST_SIZE;
+            origin[MAXPATH - 1] = '\0';
+        } else if (h->length != REQUEST_SIZE) {
+            return 1;
+        }
+        // A new request ends whatever the stream was doing.
+        end_admission(conn, st);
+        struct request *ser_rec = &st->req;
+        decode_request(conn->payload, ser_rec);
+        ser_rec->type = ntohl(ser_rec->type);
+        ser_rec->size = be64toh(ser_rec->size);
+        ser_rec->mtime = be64toh(ser_rec->mtime);
+        ser_rec->path[MAXPATH - 1] = '\0';
+
+        D("%d\n", ser_rec->type);
+        D("%o\n", (ser_rec->mode) & 0777);
+        for (int i = 0; i < HASH_SIZE; i++) {
+            D("%hhx ", ser_rec->hash[i]);
+        }
+        D("\n%lld\n", (long long)ser_rec->size);
+
+        // Metadata comes on stream 0, each transfer on a stream of its own.
+        st->state = AWAITING_REQUEST;
+        if (h->stream == METADATA_STREAM) {
+            result = (ser_rec->type == TRANSFILE) ? ERROR : answer_request(tree, content, ser_rec, origin);
+        } else if (ser_rec->type == TRANSFILE) {
+            result = start_receiving(tree, st);
+        } else {
+            result = ERROR;
+        }
+        if (result == ERROR && h->stream != METADATA_STREAM) {
+            // The client may already be sending data for it.
+            st->state = DISCARDING_DATA;
+        }
 
-    // if server responds OK, current file identical with server.
-    } else if (rec_int == OK) {
-        // REGULAR FILE: file identical with server, terminate without error.
-        if (S_ISREG(stat_src.st_mode)) {
-            return 0;
-        //DIRECTORY: Go through this directory.
-        } else if (S_ISDIR(stat_src.st_mode)) {
-            DIR *src_dirp = opendir(source);
-            // if no read permission, error.
-            if (src_dirp == NULL) {
-                perror("client: opendir");
-                fprintf(stderr, "ERROR: %s\n", req_src.path);
-                return 1;
-            }
-            struct dirent *dp = readdir(src_dirp);
-            char *src_child;
-            while (dp != NULL){
-                // Ignore the file named '.' at the beginning.
-                if ((*dp).d_name[0] != '.'){
-                    src_child = generate_path(abs_src, (*dp).d_name);
-                    // Get information of child.
-                    struct stat stat_src_child;
-                    if (lstat(src_child, &stat_src_child) == -1) {
-                        perror("client: lstat");
-                        return 1;
-                    }
-                    // If child is a DIRECTORY.
-                    if (S_ISDIR(stat_src_child.st_mode)) {
-                        i++;
-                        int re = rcopy_client(src_child, host, port);
-                        // we free the memory that we have malloc'ed.
-                        free(src_child);
-                        if (re != 0) {
-                            neg_flag = 1;
-                        }
-                    // If child is a REGULAR FILE.
-                    } else if (S_ISREG(stat_src_child.st_mode)) {
-                        i++;
-                        int re = rcopy_client(src_child, host, port);
-                        // we free the memory that we have malloc'ed.
-                        free(src_child);
-                        if (re != 0) {
-                            neg_flag = 1;
-                        }
-                    // If child is a LINK.
-                    } else if (S_ISLNK(stat_src_child.st_mode)) {
-                        // Ignore links.
-                    // If child is in strange type.
-                    } else {
-                        // shouldn't get here.
-                        return 1;
-                    }
-                }
-                // Move on to next child in directory.
-                dp = readdir(src_dirp);
-            }
-        // File is in strange file type.
+    } else if (h->type == FRAME_FD && h->stream != METADATA_STREAM) {
+        // The file that came with the frame is first in line.
+        if (conn->num_passed_fds == 0) {
+            return 1;
+        }
+        int src_fd = conn->passed_fds[0];
+        conn->num_passed_fds--;
+        memmove(conn->passed_fds, conn->passed_fds + 1, conn->num_passed_fds * sizeof(int));
+        if (st->state != AWAITING_DATA) {
+            close(src_fd);
+            return st->state == DISCARDING_DATA ? 0 : 1;
+        }
+        result = receive_fd(tree, content, st, src_fd);
+        close(src_fd);
+        st->state = (result == OK) ? AWAITING_REQUEST : DISCARDING_DATA;
+
+    } else if (h->type == FRAME_WINDOW && h->stream == METADATA_STREAM) {
+        // The client's window, which comes before its first request.
+        if (h->length != sizeof(int)) {
+            return 1;
+        }
+        int tmp;
+        memcpy(&tmp, conn->payload, sizeof(int));
+        long value = ntohl(tmp);
+        if (value < MIN_STREAM_WINDOW) {
+            return 1;
+        }
+        if (value < server_options.stream_window) {
+            conn->stream_window = value;
         } else {
-            fprintf(stderr, "File type error!\n");
-            exit(1);
+            conn->stream_window = server_options.stream_window;
         }
+        return 0;
 
-    // if server responds SENDFILE, file data are different, file needs to be send.
-    } else if (rec_int == SENDFILE) {
-        // Create new process to send file data.
-        pid_t pid = fork();
-
-        //CHILD process sends file data to server.
-        if (pid == 0) {
-            // First, set up new socket connection.
-            int child_sock_fd;
-            struct sockaddr_in child_server;
-            struct hostent *child_hp;
-            if ((child_hp = gethostbyname(host)) == NULL) {
-                perror("child_client: gethostbyname");
-                exit(1);
-            }
-            if ((child_sock_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-                perror("child_client: socket");
-                exit(1);
-            }
-
-            // Set the IP and port of the server to connect to.
-            child_server.sin_family = AF_INET;
-            child_server.sin_port = htons(port);
-            child_server.sin_addr = *((struct in_addr *)child_hp->h_addr);
-
-            // Connect to the server.
-            if (connect(child_sock_fd, (struct sockaddr *)&child_server, sizeof(child_server)) == -1) {
-                perror("child_client: connect");
-                close(child_sock_fd);
-                exit(1);
-            }
-
-            // Next, identifies as TRANSFILE client and send request struct.
-            struct request child_req_src = req_src;
-            child_req_src.type = htonl(TRANSFILE);
-            // Then upload every field of this struct one at a time to the server.
-            // The order is: type -> path -> mode -> hash -> size.
-            if (write(child_sock_fd, &(child_req_src.type), sizeof(int)) == -1) {
-                perror("child_client: write");
-                close(child_sock_fd);
-                exit(1);
-            }
-            if (write(child_sock_fd, child_req_src.path, MAXPATH) == -1) {
-                perror("child_client: write");
-                close(child_sock_fd);
-                exit(1);
-            }
-            if (write(child_sock_fd, &(child_req_src.mode), 4) == -1) {
-                perror("child_client: write");
-                close(child_sock_fd);
-                exit(1);
-            }
-            if (write(child_sock_fd, child_req_src.hash, BLOCKSIZE) == -1) {
-                perror("child_client: write");
-                close(child_sock_fd);
-                exit(1);
-            }
-            if (write(child_sock_fd, &(child_req_src.size), sizeof(int)) == -1) {
-                perror("child_client: write");
-                close(child_sock_fd);
-                exit(1);
-            }
-
-            // Transmit data without waiting.
-            FILE *src = fopen(source, "rb");
-            char buffer[MAXDATA];
-            int byte;
-            while ((byte = fread(buffer, 1, MAXDATA, src)) != 0) {
-                if (write(child_sock_fd, buffer, byte) == -1) {
-                    return 1;
-                }
-            }
-            if (fclose(src) != 0){
-              perror("client: fclose");
-              return 1;
+    } else if ((h->type == FRAME_DATA || h->type == FRAME_HOLE) && h->stream != METADATA_STREAM) {
+        if (st->state == DISCARDING_DATA) {
+            return 0;
+        }
+        if (st->state != AWAITING_DATA) {
+            return 1;
+        }
+        if (h->type == FRAME_DATA) {
+            use_credit(conn, st, h->length);
+        }
+        if (h->type == FRAME_HOLE) {
+            if (h->length != 8) {
+                return 1;
             }
-
-            // Then wait for server's message.
-            int child_tmp, child_rec_int;
-            if (read(child_sock_fd, &child_tmp, sizeof(int)) == -1) {
-                perror("child_client: read");
-                close(child_sock_fd);
-                exit(1);
+            uint64_t length = 0;
+            for (int i = 0; i < 8; i++) {
+                length = (length << 8) | (unsigned char)conn->payload[i];
             }
-            child_rec_int = ntohl(child_tmp);
-
-            // if data transmit successes, end connection with server, terminate child process.
-            if (child_rec_int == OK) {
-                close(child_sock_fd);
-                exit(0);
-
-            // if data transmit proccess encounters ERROR, report error then terminates.
-            } else {
-                // upload file to a non-writable dir.
-                fprintf(stderr, "child_client permission ERROR!\n");
-                fprintf(stderr, "ERROR: %s\n", child_req_src.path);
-                exit(1);
+            // Anything longer than the rest of the file is an error there.
+            if (length > (uint64_t)st->data_left) {
+                length = st->data_left + 1;
             }
-        // PARENT process increments process count.
+            result = receive_data(tree, content, st, NULL, length);
         } else {
-            num_child_process++;
+            result = receive_data(tree, content, st, conn->payload, h->length);
         }
-    // if server responds strange message.
-    } else {
-        fprintf(stderr, "ERROR int received from the sever!\n");
-        exit(1);
-    }
-    // Finally, wait for all children.
-    for (int i = 1; i <= num_child_process; i++) {
-        int tmp;
-        char rvalue = 0;
-        if (wait(&tmp) == -1) { // Waiting...
-            perror("client: wait");
-            exit(1);
-        } else {
-            if(WIFEXITED(tmp)) {
-                rvalue = WEXITSTATUS(tmp);
-            } else {
-                return 1;
+        if (result == -1) {
+            // The data is on disk, so the client may send as much more.
+            // Holes take no room, so there is nothing to hand back.
+            if (h->type == FRAME_DATA) {
+                grant_window(fd, conn, st, h->stream, h->length);
             }
+        } else {
+            st->state = (result == OK) ? AWAITING_REQUEST : DISCARDING_DATA;
         }
-        // if child processes entoured error, notify error indicator.
-        if (rvalue == 1){
-            neg_flag = 1;
-        }
-    }
-    return neg_flag;
-}
-
-// ================ client part ends ================
 
+    } else {
+        return 1;
+    }
 
+    // A transfer counts against the admission limits while it receives.
+    if (st->state == AWAITING_DATA && !st->admitted && !st->queued) {
+        request_admission(conn, st);
+    } else if (st->state != AWAITING_DATA) {
+        end_admission(conn, st);
+    }
 
-// ================ server part starts ================
+    if (result == OK && changed) {
+        defer_response(fd, h->stream);
+    } else if (result != -1) {
+        respond(fd, h->stream, result);
+    }
+    return 0;
+}
 
 /*
- * This function takes a file descriptor fd, a destination pointer dest, a size
- * and a fd_set pointer set as inputs, and read data from fd and store it into
- * dest. If it succeeds return 0, otherwise return 1.
+ * This function takes the file descriptor fd of a client connection conn
+ * that has become readable, the tree index tree and the content index
+ * content as inputs, and reads the next part of the current frame,
+ * handling it once it is complete.
+ * If the connection is still open return 0, otherwise return 1.
  */
-int read_struct_field(int fd, void *dest, int size, fd_set *set) {
+static int read_connection(int fd, struct connection *conn,
+                           struct tree_index *tree, struct content_index *content) {
+    char *dest;
+    uint32_t size;
+    if (conn->state == AWAITING_HEADER) {
+        dest = conn->header;
+        size = FRAME_HEADER_SIZE;
+    } else {
+        dest = conn->payload;
+        size = conn->frame.length;
+    }
+
     int n;
-    if ((n = read(fd, dest, size)) == -1) {
+    if (conn->local) {
+        n = read_with_fds(fd, dest + conn->received, size - conn->received,
+                          conn->passed_fds, &conn->num_passed_fds, MAX_STREAMS);
+    } else {
+        n = read(fd, dest + conn->received, size - conn->received);
+    }
+    if (n == -1) {
         perror("server: read");
-        close(fd);
-        FD_CLR(fd, set);
         return 1;
     } else if (n == 0) {
         printf("CLIENT [%d] HAS DISCONNECTED.\n", fd);
-        close(fd);
-        FD_CLR(fd, set);
+        for (int s = 1; s <= MAX_STREAMS; s++) {
+            if (conn->streams[s].state == AWAITING_DATA) {
+                fprintf(stderr, "ERROR!! EARLY TERMINATION.\n");
+                fprintf(stderr, "ERROR: %s\n", conn->streams[s].req.path);
+            }
+        }
         return 1;
     }
     D("BYTES RECEIVED [%d]\n", n);
+    conn->received += n;
+    if (conn->received < size) {
+        return 0;
+    }
+
+    conn->received = 0;
+    if (conn->state == AWAITING_HEADER) {
+        decode_frame_header(conn->header, &conn->frame);
+        if (conn->frame.stream > MAX_STREAMS || conn->frame.length > MAX_FRAME_DATA) {
+            fprintf(stderr, "CLIENT [%d] SENT A BAD FRAME.\n", fd);
+            return 1;
+        }
+        if (conn->frame.length > 0) {
+            conn->state = AWAITING_PAYLOAD;
+            return 0;
+        }
+    }
+    conn->state = AWAITING_HEADER;
+    if (handle_frame(fd, conn, tree, content) != 0) {
+        fprintf(stderr, "CLIENT [%d] SENT A BAD FRAME.\n", fd);
+        return 1;
+    }
     return 0;
 }
 
 /*
- * This function takes a file descriptor fd and a int representing message as
- * inputs, then it converts the message into network byte order and sends a
- * response to the client.
+ * This function takes the path of a Unix domain socket as input, and
+ * returns a socket listening on it for clients on the same host. A stale
+ * socket file left behind by an earlier server is replaced.
  */
-void respond(int fd, int message) {
-    int response = htonl(message);
-    D("RESPONSE: %d\n", message);
-    if (write(fd, &response, sizeof(int)) == -1) {
-        perror("server: write");
+static int listen_local(const char *path) {
+    struct sockaddr_un local;
+    memset(&local, 0, sizeof(local));
+    local.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(local.sun_path)) {
+        fprintf(stderr, "server: socket path too long: %s\n", path);
+        exit(1);
+    }
+    strcpy(local.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("server: socket");
+        exit(1);
+    }
+    struct stat stat_sock;
+    if (lstat(path, &stat_sock) == 0 && S_ISSOCK(stat_sock.st_mode)) {
+        unlink(path);
+    }
+    if (bind(fd, (struct sockaddr *)&local, sizeof(local)) < 0) {
+        perror("server: bind");
+        close(fd);
+        exit(1);
+    }
+    if (listen(fd, MAX_BACKLOG) < 0) {
+        perror("server: listen");
+        close(fd);
+        exit(1);
+    }
+    return fd;
+}
+
+/*
+ * This function takes a listening socket listener as input, and accepts
+ * the next client waiting on it, storing its IPv4 address in addr (0 for
+ * a local client). It returns the new connection, or -1 if no client is
+ * waiting, or if the server is out of descriptors and the rest have to
+ * wait in the backlog until some connection closes.
+ */
+static int accept_client(int listener, uint32_t *addr) {
+    while (1) {
+        struct sockaddr_in client;
+        socklen_t client_len = sizeof(client);
+        int fd = accept(listener, (struct sockaddr *)&client, &client_len);
+        if (fd >= 0) {
+            *addr = (client.sin_family == AF_INET) ? client.sin_addr.s_addr : 0;
+            return fd;
+        }
+        if (errno == EINTR || errno == ECONNABORTED) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return -1;
+        }
+        perror("server: accept");
+        if (errno == EMFILE || errno == ENFILE) {
+            return -1;
+        }
+        exit(1);
+    }
+}
+
+/*
+ * This function takes the file descriptor fd of a client connection conn
+ * as input, and closes it along with any files the client has passed that
+ * weren't used. Its transfers no longer count against the limits.
+ */
+static void close_connection(int fd, struct connection *conn) {
+    for (int i = 0; i < conn->num_passed_fds; i++) {
+        close(conn->passed_fds[i]);
     }
+    for (int s = 1; s <= MAX_STREAMS; s++) {
+        end_admission(conn, &conn->streams[s]);
+    }
+    conn->peer->connections--;
+    close(fd);
+    free(conn);
 }
 
 /*
@@ -464,6 +2749,17 @@ void rcopy_server(unsigned short port) {
     // forget, but on others, you'll get mysterious errors. So zero it.
     memset(&server.sin_zero, 0, 8);
 
+    // Accepted sockets inherit the receive buffer size, which must be set
+    // before the handshake.
+    size_socket_buffer(sock_fd, SO_RCVBUF, CONNECTION_WINDOW(server_options.stream_window));
+
+    // Restart at once, instead of waiting for connections of the last
+    // run to leave TIME_WAIT.
+    int on = 1;
+    if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
+        perror("server: setsockopt");
+    }
+
     // Bind the selected port to the socket.
     if (bind(sock_fd, (struct sockaddr *)&server, sizeof(server)) < 0) {
         perror("server: bind");
@@ -478,410 +2774,135 @@ void rcopy_server(unsigned short port) {
         exit(1);
     }
 
+    // Clients on the same host may also connect through a Unix domain
+    // socket, and then pass their files instead of sending the data.
+    int local_fd = -1;
+    if (server_options.local_socket != NULL) {
+        local_fd = listen_local(server_options.local_socket);
+    }
+    // Every waiting client is accepted in one go (see accept_client()).
+    int listeners[2] = {sock_fd, local_fd};
+    for (int i = 0; i < 2; i++) {
+        if (listeners[i] != -1 && fcntl(listeners[i], F_SETFL, O_NONBLOCK) == -1) {
+            perror("server: fcntl");
+            exit(1);
+        }
+    }
+
     // First, we prepare to listen to multiple
     // file descriptors by initializing a set of file descriptors.
-    int max_fd = sock_fd;
+    int max_fd = sock_fd > local_fd ? sock_fd : local_fd;
     fd_set all_fds, listen_fds;
     FD_ZERO(&all_fds);
     FD_SET(sock_fd, &all_fds);
+    if (local_fd != -1) {
+        FD_SET(local_fd, &all_fds);
+    }
 
-    // Keep track of the status of each file descriptor.
+    // Index the dest tree, so that most requests can be answered from
+    // memory, and the content that is already stored, so that files the
+    // server has seen before (from any client) need not be sent again.
+    // This reads (hashes) every file in dest once, before the first
+    // client is accepted.
+    // Note: this assumes that only the server changes the dest tree.
+    struct tree_index tree;
+    struct content_index content;
+    tree_index_init(&tree);
+    content_index_init(&content);
+    printf("Indexed %ld entries.\n", tree_index_scan(&tree, &content, "."));
+
+    // Keep track of the state of each client connection.
     // We assume the maximum file descriptor is 1024.
-    int state_of_client[1024] = {0};
-    int client_data_left[1024] = {0};
-    struct request struct_arr[1024];
+    struct connection *connections[1024] = {NULL};
 
     // The server process goes into an infinite loop.
     while (1) {
         // Select updates the fd_set it receives,
         // so we always use a copy and retain the original.
         listen_fds = all_fds;
-        int nready = select(max_fd + 1, &listen_fds, NULL, NULL, NULL);
+        // Connections whose transfers all wait for admission aren't read.
+        for (int fd = 3; num_queued > 0 && fd <= max_fd; fd++) {
+            if (connections[fd] != NULL && is_paused(connections[fd])) {
+                FD_CLR(fd, &listen_fds);
+            }
+        }
+        // With a group commit pending, don't sleep at all: once there
+        // is nothing left to read, no more files are about to join the
+        // group, and it is committed right away (see below).
+        struct timeval timeout = {0, 0}, *wait = NULL;
+        if (group_commit_due() >= 0) {
+            wait = &timeout;
+        }
+        int nready = select(max_fd + 1, &listen_fds, NULL, NULL, wait);
         if (nready == -1) {
             perror("server: select");
             exit(1);
         }
-        // Is it the original socket? Create a new connection ...
-        if (FD_ISSET(sock_fd, &listen_fds)) {
-            int client_fd = accept(sock_fd, NULL, NULL);
-            if (client_fd < 0) {
-                perror("server: accept");
-                close(sock_fd);
-                exit(1);
+        // Is it one of the original sockets? Create new connections ...
+        for (int i = 0; i < 2; i++) {
+            if (listeners[i] == -1 || !FD_ISSET(listeners[i], &listen_fds)) {
+                continue;
             }
-            // Update the maximum file descriptor.
-            if (client_fd > max_fd) {
-                max_fd = client_fd;
+            int client_fd;
+            uint32_t addr;
+            while ((client_fd = accept_client(listeners[i], &addr)) != -1) {
+                if (client_fd >= 1024) {
+                    fprintf(stderr, "TOO MANY CLIENTS.\n");
+                    close(client_fd);
+                    continue;
+                }
+                // Update the maximum file descriptor.
+                if (client_fd > max_fd) {
+                    max_fd = client_fd;
+                }
+                connections[client_fd] = calloc(1, sizeof(struct connection));
+                if (connections[client_fd] == NULL) {
+                    perror("server: calloc");
+                    exit(1);
+                }
+                for (int s = 0; s <= MAX_STREAMS; s++) {
+                    connections[client_fd]->streams[s].fd = -1;
+                }
+                if (listeners[i] == local_fd) {
+                    connections[client_fd]->local = 1;
+                } else {
+                    set_nodelay(client_fd);
+                }
+                connections[client_fd]->peer = find_peer(addr);
+                connections[client_fd]->peer->connections++;
+                // Until the client's window arrives, it is taken to be the default.
+                connections[client_fd]->stream_window =
+                    (server_options.stream_window < DEFAULT_STREAM_WINDOW)
+                    ? server_options.stream_window : DEFAULT_STREAM_WINDOW;
+                if (write_frame_int(client_fd, METADATA_STREAM, FRAME_WINDOW,
+                                    server_options.stream_window) == -1) {
+                    perror("server: write");
+                }
+                FD_SET(client_fd, &all_fds);
+                D("Accepted connection\n");
             }
-            FD_SET(client_fd, &all_fds);
-            D("Accepted connection\n");
         }
 
         // After each select call, loop over file descriptors that are ready to read.
         for (int fd = 3; fd <= max_fd; fd++) {
-            if ((fd != sock_fd) && FD_ISSET(fd, &listen_fds)) {
+            if ((fd != sock_fd) && (fd != local_fd) && FD_ISSET(fd, &listen_fds)) {
                 // Note: never reduces max_fd
-
-                // We do this to prevent two connections changing one
-                // struct simultaneously, which causes segfault.
-                struct request *ser_rec = &struct_arr[fd];
-
-                // Split into cases, and read each field of the struct.
-                if (state_of_client[fd] == AWAITING_TYPE) {
-                    if (read_struct_field(fd, &(ser_rec->type), sizeof(int), &all_fds)) {
-                        state_of_client[fd] = AWAITING_TYPE;
-                        continue;
-                    }
-                    ser_rec->type = ntohl(ser_rec->type);
-                    state_of_client[fd] = AWAITING_PATH;
-                    continue;
-                } else if (state_of_client[fd] == AWAITING_PATH) {
-                    if (read_struct_field(fd, ser_rec->path, MAXPATH, &all_fds)) {
-                        state_of_client[fd] = AWAITING_TYPE;
-                        continue;
-                    }
-                    state_of_client[fd] = AWAITING_PERM;
-                    continue;
-                } else if (state_of_client[fd] == AWAITING_PERM) {
-                    if (read_struct_field(fd, &(ser_rec->mode), 4, &all_fds)) {
-                        state_of_client[fd] = AWAITING_TYPE;
-                        continue;
-                    }
-                    state_of_client[fd] = AWAITING_HASH;
-                    continue;
-                } else if (state_of_client[fd] == AWAITING_HASH) {
-                    if (read_struct_field(fd, ser_rec->hash, BLOCKSIZE, &all_fds)) {
-                        state_of_client[fd] = AWAITING_TYPE;
-                        continue;
-                    }
-                    state_of_client[fd] = AWAITING_SIZE;
-                    continue;
-                } else if (state_of_client[fd] == AWAITING_SIZE) {
-                    // This is the last part of the struct that we read.
-                    if (read_struct_field(fd, &(ser_rec->size), sizeof(int), &all_fds)) {
-                        state_of_client[fd] = AWAITING_TYPE;
-                        continue;
-                    }
-                    ser_rec->size = ntohl(ser_rec->size);
-                    state_of_client[fd] = AWAITING_TYPE;
-
-                    D("%d\n", ser_rec->type);
-                    // printf("%s\n", ser_rec->path);
-                    D("%o\n", (ser_rec->mode) & 0777);
-                    for (int i = 0; i < 8; i++) {
-                        D("%hhx ", ser_rec->hash[i]);
-                    }
-                    D("\n%d\n", ser_rec->size);
-
-
-                    client_data_left[fd] = ser_rec->size;
-                    // We have received the whole struct.
-                    if (ser_rec->type == REGFILE) {
-                        // Try to open it.
-                        FILE *f = fopen(ser_rec->path, "rb");
-                        if (f == NULL) { // If an error occurs when we try to open this file.
-                            if (errno == ENOENT) { // If the file doesn't exist.
-                                respond(fd, SENDFILE);
-                                continue;
-                            } else {
-                                perror("server: fopen");
-                                fprintf(stderr, "ERROR: %s\n", ser_rec->path);
-                                respond(fd, ERROR);
-                                continue;
-                            }
-                        } else { // If NO error occurs when we try to open this file.
-                            // This means that this file exits and we have already opened it.
-                            struct stat stat_file;
-                            lstat(ser_rec->path, &stat_file);
-                            // If this is not a file, this means there is a mismatch.
-                            if (!S_ISREG(stat_file.st_mode)) {
-                                if (fclose(f) == EOF) {
-                                    perror("server: fclose");
-                                    continue;
-                                }
-                                fprintf(stderr, "NOT A FILE: %s\n", ser_rec->path);
-                                // Mismatch, try to change the permission.
-                                if (chmod(ser_rec->path, (ser_rec->mode) & 0777) == -1) {
-                                    perror("server: chmod");
-                                    respond(fd, ERROR);
-                                    continue;
-                                }
-                                respond(fd, ERROR);
-                                continue;
-                            }
-                            // If there is no mismatch.
-                            // First check if their sizes are different.
-                            if (ser_rec->size != stat_file.st_size) {
-                                // If sizes are different, copy the file.
-                                if (fclose(f) == EOF) {
-                                    perror("server: fclose");
-                                    continue;
-                                }
-                                // Send a SENDFILE message to the client.
-                                respond(fd, SENDFILE);
-                                continue;
-
-                            } else { // If sizes are the same, we check hash and permission.
-                                char blank[BLOCKSIZE];
-                                char *hash_dest = hash(blank, f);
-                                if (check_hash(ser_rec->hash, hash_dest) == 0) {
-                                    if (fclose(f) == EOF) {
-                                        perror("server: fclose");
-                                        continue;
-                                    }
-                                    // If hash is same, then check permission.
-                                    if (((stat_file.st_mode) & 0777) != ((ser_rec->mode) & 0777)) {
-                                        if (chmod(ser_rec->path, (ser_rec->mode) & 0777) == -1) {
-                                            perror("server: chmod");
-                                            respond(fd, ERROR);
-                                            continue;
-                                        }
-                                    }
-                                    respond(fd, OK);
-                                    continue;
-                                } else {
-                                    if (fclose(f) == EOF) {
-                                        perror("fclose");
-                                        continue;
-                                    }
-                                    // If hash is different, then copy the file.
-                                    respond(fd, SENDFILE);
-                                    continue;
-                                }
-                            }
-                        }
-
-                    // If the struct that we received is a directory.
-                    } else if (ser_rec->type == REGDIR) {
-                        printf("%s\n", ser_rec->path);
-                        struct stat stat_dir;
-                        if (lstat(ser_rec->path, &stat_dir) == -1) {
-                            if (errno == ENOENT) { // If the directory doesn't exist.
-                                // Make a directory, and properly set its permission.
-                                if (mkdir(ser_rec->path, 0777) == -1) {
-                                    perror("server: mkdir");
-                                    respond(fd, ERROR);
-                                    continue;
-                                }
-                                if (chmod(ser_rec->path, (ser_rec->mode) & 0777) == -1) {
-                                    perror("server: chmod");
-                                    respond(fd, ERROR);
-                                    continue;
-                                }
-                            } else if (errno == EACCES) { // If we don't have read permission for dest directory.
-                                perror("server: lstat");
-                                // We change its permission if possible.
-                                if (chmod(ser_rec->path, (ser_rec->mode) & 0777) == -1) {
-                                    perror("server: chmod");
-                                    respond(fd, ERROR);
-                                    continue;
-                                }
-                            } else { // If due to other errors.
-                                perror("server: lstat");
-                                respond(fd, ERROR);
-                                continue;
-                            }
-                            respond(fd, OK);
-                            continue;
-                        } else { // If NO error orrurs.
-                            // Check the permission.
-                            if (((stat_dir.st_mode) & 0777) != ((ser_rec->mode) & 0777)) {
-                                if (chmod(ser_rec->path, (ser_rec->mode) & 0777) == -1) {
-                                    perror("server: chmod");
-                                    respond(fd, ERROR);
-                                    continue;
-                                }
-                            }
-                            if (S_ISDIR(stat_dir.st_mode)) {
-                                respond(fd, OK);
-                                continue;
-                            } else {
-                                // If it's not a directory, then there is a mismatch.
-                                fprintf(stderr, "NOT A DIR: %s\n", ser_rec->path);
-                                respond(fd, ERROR);
-                                continue;
-                            }
-
-                        }
-
-                    // If the type of struct received is TRANSFILE.
-                    } else if (ser_rec->type == TRANSFILE) {
-                        struct stat stat_file;
-                        if (lstat(ser_rec->path, &stat_file) == 0) {
-                            // If the file exits, we remove the file first.
-                            if (remove(ser_rec->path) == -1) {
-                                perror("server: remove");
-                                respond(fd, ERROR);
-                                continue;
-                            }
-                        }
-
-                        // If the file doesn't exist.
-                        // There is an exceptional case where the file size is 0.
-                        // This means that there is no data to be transferred.
-                        if (ser_rec->size == 0) {
-                            // Create an empty file.
-                            FILE *dest_empty_file = fopen(ser_rec->path,"w");
-                            if (dest_empty_file == NULL) {
-                                perror("server: fopen");
-                                respond(fd, ERROR);
-                                continue;
-                            }
-                            if (fclose(dest_empty_file) == EOF) {
-                                perror("server: fopen");
-                                respond(fd, ERROR);
-                                continue;
-                            }
-
-                            if (chmod(ser_rec->path, (ser_rec->mode) & 0777) == -1) {
-                                fprintf(stderr, "ERROR while changing empty file's permission: \n%s\n", ser_rec->path);
-                                respond(fd, ERROR);
-                            } else {
-                                respond(fd, OK);
-                            }
-                            continue;
-
-                        } else {
-                            // No reply required.
-                            state_of_client[fd] = AWAITING_DATA;
-                            continue;
-
-                        }
-
-                    } else {
-                        // Can't happen.
-                        respond(fd, ERROR);
-                        continue;
-                    }
-                    continue;
-
-                } else if (state_of_client[fd] == AWAITING_DATA) {
-
-                    char tmp[MAXDATA];
-                    int bytes = read(fd, tmp, MAXDATA);
-                    // Read the data into tmp.
-
-                    if (bytes == -1) {
-                        perror("server: read");
-                        respond(fd, ERROR);
-                        state_of_client[fd] = AWAITING_TYPE;
-                        close(fd);
-                        continue;
-                    } else if (bytes == 0) {
-                        // Bytes 0 indicates that socket is closed.
-                        if (client_data_left[fd] != 0) {
-                            fprintf(stderr, "ERROR!! EARLY TERMINATION.\n");
-                            fprintf(stderr, "ERROR: %s\n", struct_arr[fd].path);
-                            close(fd);
-                            FD_CLR(fd, &all_fds);
-                            state_of_client[fd] = AWAITING_TYPE;
-                            continue;
-                        } else {
-                            fprintf(stderr, "SOMETHING STRANGE HAPPENS.\n");
-                            close(fd);
-                            FD_CLR(fd, &all_fds);
-                            state_of_client[fd] = AWAITING_TYPE;
-                            continue;
-                        }
-                    } else {
-                        // If there is no error, open/create a file and append
-                        // the data to it.
-                        FILE *dest_file = fopen(ser_rec->path,"a");
-                        if (dest_file == NULL) {
-                            // Server get a file piece of data that under a non-writable dir.
-                            perror("server: fopen");
-                            fprintf(stderr, "ERROR: %s\n", ser_rec->path);
-                            respond(fd, ERROR);
-                            close(fd);
-                            FD_CLR(fd, &all_fds);
-                            state_of_client[fd] = AWAITING_TYPE;
-                            continue;
-                        }
-                        // If no error in fopen, then we write data to it.
-                        fwrite(tmp, bytes, 1, dest_file);
-                        // Update the number of data left.
-                        client_data_left[fd] -= bytes;
-                        if (fclose(dest_file) == EOF) {
-                            perror("server: fclose");
-                            close(fd);
-                            FD_CLR(fd, &all_fds);
-                            state_of_client[fd] = AWAITING_TYPE;
-                            continue;
-                        }
-                    }
-
-                    // If data left is 0, i.e. file transfer is completed.
-                    if (client_data_left[fd] == 0) {
-                        printf("File transfer is completed!\n");
-                        // Reset the state of client.
-                        state_of_client[fd] = AWAITING_TYPE;
-                        struct stat stat_file_received;
-                        // Get the info of the file received.
-                        lstat(ser_rec->path, &stat_file_received);
-
-                        // First check if their sizes are different.
-                        if (ser_rec->size != stat_file_received.st_size) {
-                            // If sizes are different, we report the error.
-                            fprintf(stderr, "ERROR! File received is different from the original file.\n");
-                            fprintf(stderr, "ERROR: %s\n", ser_rec->path);
-                            respond(fd, ERROR);
-
-                        } else { // If sizes are the same, we check hash and permission.
-                            char blank[BLOCKSIZE];
-                            FILE *fm = fopen(ser_rec->path, "rb");
-                            if (fm == NULL) {
-                                perror("server: fopen");
-                                continue;
-                            }
-                            // Calculate hash.
-                            char *hash_dest = hash(blank, fm);
-                            if (fclose(fm) == EOF) {
-                                perror("server: fclose");
-                                continue;
-                            }
-                            if (check_hash(ser_rec->hash, hash_dest) == 0) {
-                                // If hash is same, then we change permission.
-                                if (chmod(ser_rec->path, (ser_rec->mode) & 0777) == -1) {
-                                    fprintf(stderr, "ERROR WHILE CHANGING PERMISSION: %s\n", ser_rec->path);
-                                    respond(fd, ERROR);
-
-                                } else {
-                                    printf("%s\n", ser_rec->path);
-                                    respond(fd, OK);
-                                }
-
-                            } else {
-                                // If hashes are different, we report the error.
-                                fprintf(stderr, "ERROR! File received is different from the original file.\n");
-                                fprintf(stderr, "ERROR: %s\n", ser_rec->path);
-                                respond(fd, ERROR);
-                            }
-                        }
-                        close(fd);
-                        FD_CLR(fd, &all_fds);
-
-                    // If data left is less than 0, the file received should be
-                    // different from the one sent from the client.
-                    } else if (client_data_left[fd] < 0) {
-                        // Reset the state of client.
-                        state_of_client[fd] = AWAITING_TYPE;
-                        // Report the error.
-                        fprintf(stderr, "ERROR! File received is different from the original file.\n");
-                        fprintf(stderr, "ERROR: %s\n", ser_rec->path);
-                        respond(fd, ERROR);
-                        close(fd);
-                        FD_CLR(fd, &all_fds);
-                    }
-                    continue;
-                } else {
-                    // Something strange happens.
-                    state_of_client[fd] = AWAITING_TYPE;
-                    continue;
+                if (read_connection(fd, connections[fd], &tree, &content) != 0) {
+                    FD_CLR(fd, &all_fds);
+                    forget_deferred(fd);
+                    close_connection(fd, connections[fd]);
+                    connections[fd] = NULL;
                 }
-
             }
         }
+        // Closed connections and finished transfers make room for others.
+        if (num_queued > 0 || num_withheld > 0) {
+            admit_waiting(connections, max_fd);
+        }
+        // Commit when idle, or when the oldest response has waited long
+        // enough under a steady stream of requests.
+        if (nready == 0 || group_commit_due() == 0) {
+            commit_group();
+        }
     }
-    // At last, we free the memory that we have malloc'ed.
-    free(str_parent);
 }
@@ -1,42 +1,111 @@
 #ifndef _FTREE_H_
 #define _FTREE_H_
 
+#include <stdint.h>
 #include <sys/stat.h>
 #include "hash.h"
 
 #define MAXPATH 128
 #define MAXDATA 256
 
-// Input states
-#define AWAITING_TYPE 0
-#define AWAITING_PATH 1
-#define AWAITING_SIZE 2
-#define AWAITING_PERM 3
-#define AWAITING_HASH 4
-#define AWAITING_DATA 5
+// Input states of a connection
+#define AWAITING_HEADER 0
+#define AWAITING_PAYLOAD 1
+
+// States of a file transfer stream
+#define AWAITING_REQUEST 0
+#define AWAITING_DATA 1
+#define DISCARDING_DATA 2   // the transfer failed, drop the rest of its data
 
 // Request types
 #define REGFILE 1
 #define REGDIR 2
 #define TRANSFILE 3
+#define STATFILE 4  // a regular file, compared by size and mtime instead of hash
 
 #define OK 0
 #define SENDFILE 1
 #define ERROR 2
+#define SKIPDIR 3   // REGDIR only: the whole subtree is already identical
+
+// The mtime of a request that doesn't carry one. Any other value,
+// including 0 (the epoch, as in reproducible builds), is a real mtime.
+#define NO_MTIME INT64_MIN
 
 #ifndef PORT
     #define PORT 30100
 #endif
 
 struct request {
-    int type;           // Request type is REGFILE, REGDIR, TRANSFILE
+    int type;           // Request type is REGFILE, REGDIR, TRANSFILE, STATFILE
     char path[MAXPATH];
     mode_t mode;
     char hash[BLOCKSIZE];
-    int size;
+    int64_t size;       // files: bytes, so that files of 2 GiB and more fit
+    int64_t mtime;      // files: nanoseconds since the epoch, or NO_MTIME
 };
 
-int rcopy_client(char *source, char *host, unsigned short port);
+// The size of a request on the wire, see encode_request().
+#define REQUEST_SIZE (sizeof(int) + MAXPATH + 4 + BLOCKSIZE + sizeof(int64_t) + sizeof(int64_t))
+
+// Orders in which the client sends the files the server asked for.
+#define ORDER_SCAN 0            // as the scan finds them
+#define ORDER_SMALLEST 1        // the file with the least data left first
+
+// Client settings, from the command line.
+struct client_options {
+    int hash_threads;       // 0: one per online CPU
+    int zerocopy;           // send file data with MSG_ZEROCOPY
+    int stat_only;          // compare files by size and mtime, hash only what is sent
+    int order;              // ORDER_SCAN or ORDER_SMALLEST
+    char **priority;        // path patterns; files matching earlier ones go first
+    int num_priority;
+    long rate;              // bytes/s of file data over all connections, 0: no limit
+    long target_rate;       // bytes/s of file data per connection, 0: no limit
+    long stream_window;     // bytes of a file in flight at most, see mux.h
+};
+extern struct client_options client_options;
+
+// Durability modes: when the server acknowledges a file it has written.
+#define DURABILITY_NONE 0       // at once, the kernel writes it back later
+#define DURABILITY_FILE 1       // once the file itself has been synced
+#define DURABILITY_GROUP 2      // in batches, after one sync of the dest tree
+
+// Default admission limits, which a client with one connection never reaches.
+#define DEFAULT_CLIENT_TRANSFERS 32
+#define DEFAULT_CLIENT_IN_FLIGHT (32L << 20)
+#define DEFAULT_MAX_TRANSFERS 256
+#define DEFAULT_MAX_IN_FLIGHT (256L << 20)
+
+// Server settings, from the command line.
+struct server_options {
+    const char *local_socket;   // also listen on this Unix domain socket
+    int durability;
+    int client_transfers;       // files a client (by address) may send at once
+    long client_in_flight;      // bytes of file data a client may have in flight
+    int max_transfers;          // the same for all clients together
+    long max_in_flight;
+    long stream_window;         // bytes of a file a client may have in flight, see mux.h
+};
+extern struct server_options server_options;
+
+// Addresses of the form unix:PATH name a server's local socket.
+#define LOCAL_PREFIX "unix:"
+
+// The most servers a client copies to at once.
+#define MAX_TARGETS 8
+
+// The result of rcopy_client() if a server couldn't be reached or was
+// lost, besides 0 (success) and 1 (something failed).
+#define SYNC_DISCONNECTED 2
+
+char *generate_path(const char *path, char *name);
+void encode_request(const struct request *req, char *buf);
+void decode_request(const char *buf, struct request *req);
+int write_request(int fd, int stream, const struct request *req);
+int write_moved_request(int fd, const struct request *req, const char *origin);
+int rcopy_client(char *source, char **hosts, int num_hosts, unsigned short port, int recursive);
+int rcopy_watch(char *source, char **hosts, int num_hosts, unsigned short port);
 void rcopy_server(unsigned short port);
 
 #endif // _FTREE_H_
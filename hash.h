@@ -2,9 +2,19 @@
 #define _HASH_H_
 
 #define BLOCKSIZE 81
+#define HASH_SIZE 32 // SHA-256, stored at the start of a BLOCKSIZE buffer
+
+// A child of a directory, as covered by the directory's Merkle digest.
+struct merkle_child {
+    const char *name;
+    unsigned int mode;
+    long size;
+    const char *hash;   // content hash of a file, digest of a directory
+};
 
 // Hash manipulation helper functions
 char *hash(char *hash_val, FILE *f);
+char *merkle_digest(char *hash_val, struct merkle_child *children, int n);
 int check_hash(const char *hash1, const char *hash2);
 
 #endif // _HASH_H_
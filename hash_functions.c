@@ -1,31 +1,223 @@
+#define _GNU_SOURCE // SEEK_DATA, SEEK_HOLE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
-#define BLOCK_SIZE 8
+#include "hash.h"
 
-char *hash(char *hash_val, FILE *f) {
-    char ch;
-    int hash_index = 0;
+#define READ_CHUNK 65536
+
+/*
+ * SHA-256 (FIPS 180-4). The hash has to be strong enough for the server
+ * to treat two files with equal hashes as equal content, since that is
+ * what deduplication relies on.
+ */
+struct sha256_ctx {
+    uint32_t state[8];
+    uint64_t length;        // total number of bytes hashed
+    unsigned char block[64];
+    int used;               // bytes buffered in block
+};
+
+static const uint32_t k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_transform(struct sha256_ctx *ctx, const unsigned char *data) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((uint32_t)data[i * 4] << 24) | ((uint32_t)data[i * 4 + 1] << 16) |
+               ((uint32_t)data[i * 4 + 2] << 8) | data[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+    uint32_t e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+        uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    ctx->state[0] += a;
+    ctx->state[1] += b;
+    ctx->state[2] += c;
+    ctx->state[3] += d;
+    ctx->state[4] += e;
+    ctx->state[5] += f;
+    ctx->state[6] += g;
+    ctx->state[7] += h;
+}
+
+static void sha256_init(struct sha256_ctx *ctx) {
+    static const uint32_t init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->state, init, sizeof(init));
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+static void sha256_update(struct sha256_ctx *ctx, const unsigned char *data, size_t len) {
+    ctx->length += len;
+    // Top up a partially filled block first.
+    if (ctx->used > 0) {
+        size_t n = 64 - ctx->used < len ? 64 - ctx->used : len;
+        memcpy(ctx->block + ctx->used, data, n);
+        ctx->used += n;
+        data += n;
+        len -= n;
+        if (ctx->used < 64) {
+            return;
+        }
+        sha256_transform(ctx, ctx->block);
+        ctx->used = 0;
+    }
+    // Then hash whole blocks straight from the input.
+    while (len >= 64) {
+        sha256_transform(ctx, data);
+        data += 64;
+        len -= 64;
+    }
+    memcpy(ctx->block, data, len);
+    ctx->used = len;
+}
+
+static void sha256_final(struct sha256_ctx *ctx, char *digest) {
+    uint64_t bits = ctx->length * 8;
+    ctx->block[ctx->used++] = 0x80;
+    if (ctx->used > 56) {
+        memset(ctx->block + ctx->used, 0, 64 - ctx->used);
+        sha256_transform(ctx, ctx->block);
+        ctx->used = 0;
+    }
+    memset(ctx->block + ctx->used, 0, 56 - ctx->used);
+    for (int i = 0; i < 8; i++) {
+        ctx->block[56 + i] = bits >> (56 - i * 8);
+    }
+    sha256_transform(ctx, ctx->block);
+    for (int i = 0; i < 8; i++) {
+        digest[i * 4] = ctx->state[i] >> 24;
+        digest[i * 4 + 1] = ctx->state[i] >> 16;
+        digest[i * 4 + 2] = ctx->state[i] >> 8;
+        digest[i * 4 + 3] = ctx->state[i];
+    }
+}
+
+/*
+ * This function takes a hash context ctx, a sparse file fd of size bytes
+ * and a buffer of READ_CHUNK bytes as inputs, and hashes the file's
+ * content. The zeros of holes are hashed without reading them, so that
+ * the hash is the same as for the same content stored densely.
+ */
+static void hash_sparse(struct sha256_ctx *ctx, int fd, off_t size, unsigned char *buffer) {
+    static const unsigned char zeros[READ_CHUNK];
+    off_t offset = 0;
+    while (offset < size) {
+        off_t data = lseek(fd, offset, SEEK_DATA);
+        if (data == -1) {
+            // ENXIO: only a hole is left. Otherwise read everything.
+            data = (errno == ENXIO) ? size : offset;
+        }
+        off_t hole = (data < size) ? lseek(fd, data, SEEK_HOLE) : size;
+        if (hole == -1 || hole > size) {
+            hole = size;
+        }
 
-    for (int index = 0; index < BLOCK_SIZE; index++) {
-        hash_val[index] = '\0';
+        for (; offset < data; offset += READ_CHUNK) {
+            sha256_update(ctx, zeros, data - offset < READ_CHUNK ? data - offset : READ_CHUNK);
+        }
+        offset = data;
+        while (offset < hole) {
+            ssize_t n = pread(fd, buffer, hole - offset < READ_CHUNK ? hole - offset : READ_CHUNK, offset);
+            if (n <= 0) {
+                return; // shrunk since the fstat()
+            }
+            sha256_update(ctx, buffer, n);
+            offset += n;
+        }
     }
+}
 
-    while(fread(&ch, 1, 1, f) != 0) {
-        hash_val[hash_index] ^= ch;
-        hash_index = (hash_index + 1) % BLOCK_SIZE;
+char *hash(char *hash_val, FILE *f) {
+    struct sha256_ctx ctx;
+    unsigned char buffer[READ_CHUNK];
+    size_t n;
+    struct stat st;
+
+    sha256_init(&ctx);
+    // Files with fewer blocks than bytes have holes (see hash_sparse()).
+    if (ftell(f) == 0 && fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_blocks * 512 < st.st_size) {
+        hash_sparse(&ctx, fileno(f), st.st_size, buffer);
+    } else {
+        while ((n = fread(buffer, 1, READ_CHUNK, f)) != 0) {
+            sha256_update(&ctx, buffer, n);
+        }
     }
+    sha256_final(&ctx, hash_val);
 
     return hash_val;
 }
 
+static int compare_children(const void *a, const void *b) {
+    return strcmp(((const struct merkle_child *)a)->name, ((const struct merkle_child *)b)->name);
+}
 
-int check_hash(const char *hash1, const char *hash2) {
-    for (long i = 0; i < BLOCK_SIZE; i++) {
-        if (hash1[i] != hash2[i]) {
-            printf("Index %ld: %c\n", i, hash1[i]);
-            return 1;
+/*
+ * This function takes the n children of a directory as inputs, and stores
+ * the directory's Merkle digest in hash_val. The digest covers the name,
+ * type, permission, size and hash (or digest, for directories) of every
+ * child, in name order, so two directories have the same digest exactly
+ * when the trees below them are the same. children is sorted in place.
+ */
+char *merkle_digest(char *hash_val, struct merkle_child *children, int n) {
+    struct sha256_ctx ctx;
+    sha256_init(&ctx);
+    qsort(children, n, sizeof(struct merkle_child), compare_children);
+    for (int i = 0; i < n; i++) {
+        unsigned char fields[12];
+        uint32_t mode = children[i].mode & (S_IFMT | 0777);
+        uint64_t size = S_ISDIR(mode) ? 0 : (uint64_t)children[i].size;
+        for (int j = 0; j < 4; j++) {
+            fields[j] = mode >> (24 - j * 8);
+        }
+        for (int j = 0; j < 8; j++) {
+            fields[4 + j] = size >> (56 - j * 8);
         }
+        // The name includes its NUL, so that no two lists encode the same.
+        sha256_update(&ctx, (const unsigned char *)children[i].name, strlen(children[i].name) + 1);
+        sha256_update(&ctx, fields, sizeof(fields));
+        sha256_update(&ctx, (const unsigned char *)children[i].hash, HASH_SIZE);
     }
-    return 0;
+    sha256_final(&ctx, hash_val);
+    return hash_val;
+}
+
+int check_hash(const char *hash1, const char *hash2) {
+    return memcmp(hash1, hash2, HASH_SIZE) != 0;
 }
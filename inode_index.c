@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "inode_index.h"
+
+#define INITIAL_CAPACITY 1024
+
+/*
+ * This function takes a device and an inode number as inputs and returns
+ * the slot they start probing at. Inode numbers are often consecutive, so
+ * they are mixed (a 64-bit multiplicative hash) before taking the low bits.
+ */
+static long slot_of(const struct inode_index *ii, dev_t dev, ino_t ino) {
+    uint64_t h = ((uint64_t)ino ^ ((uint64_t)dev << 32)) * 0x9e3779b97f4a7c15ULL;
+    return (h >> 32) & (ii->capacity - 1);
+}
+
+/*
+ * This function takes an inode index ii, a device and an inode number as
+ * inputs, and returns the slot holding that file, or the empty slot where
+ * it would be inserted.
+ */
+static long probe(const struct inode_index *ii, dev_t dev, ino_t ino) {
+    long i = slot_of(ii, dev, ino);
+    while (ii->slots[i].path != NULL) {
+        if (ii->slots[i].ino == ino && ii->slots[i].dev == dev) {
+            return i;
+        }
+        i = (i + 1) & (ii->capacity - 1);
+    }
+    return i;
+}
+
+static void grow(struct inode_index *ii) {
+    struct inode_entry *old = ii->slots;
+    long old_capacity = ii->capacity;
+
+    ii->capacity *= 2;
+    ii->slots = calloc(ii->capacity, sizeof(struct inode_entry));
+    if (ii->slots == NULL) {
+        perror("inode_index: calloc");
+        exit(1);
+    }
+    for (long i = 0; i < old_capacity; i++) {
+        if (old[i].path != NULL) {
+            ii->slots[probe(ii, old[i].dev, old[i].ino)] = old[i];
+        }
+    }
+    free(old);
+}
+
+void inode_index_init(struct inode_index *ii) {
+    ii->capacity = INITIAL_CAPACITY;
+    ii->count = 0;
+    ii->slots = calloc(ii->capacity, sizeof(struct inode_entry));
+    if (ii->slots == NULL) {
+        perror("inode_index: calloc");
+        exit(1);
+    }
+}
+
+/*
+ * This function records that the file with the given device and inode
+ * number was sent under path, replacing the path it was known by before.
+ */
+void inode_index_add(struct inode_index *ii, dev_t dev, ino_t ino, const char *path) {
+    // Keep the load factor below 1/2 so that probe sequences stay short.
+    if ((ii->count + 1) * 2 > ii->capacity) {
+        grow(ii);
+    }
+    struct inode_entry *e = &ii->slots[probe(ii, dev, ino)];
+    if (e->path != NULL) {
+        if (strcmp(e->path, path) == 0) {
+            return;
+        }
+        free(e->path);
+    } else {
+        e->dev = dev;
+        e->ino = ino;
+        ii->count++;
+    }
+    e->path = strdup(path);
+}
+
+/*
+ * This function returns the path the file with the given device and inode
+ * number was last sent under, or NULL if it hasn't been sent yet.
+ */
+const char *inode_index_find(struct inode_index *ii, dev_t dev, ino_t ino) {
+    return ii->slots[probe(ii, dev, ino)].path;
+}
@@ -0,0 +1,28 @@
+#ifndef _INODE_INDEX_H_
+#define _INODE_INDEX_H_
+
+#include <sys/types.h>
+
+/*
+ * The inode index maps the identity of a source file (device and inode
+ * number) to the path the client last sent it under, so that a file which
+ * shows up under a new path can be recognized as moved. It is an open
+ * addressing hash table, like the content index on the server.
+ */
+struct inode_entry {
+    dev_t dev;
+    ino_t ino;
+    char *path;             // NULL if the slot is empty
+};
+
+struct inode_index {
+    struct inode_entry *slots;
+    long capacity;          // always a power of 2
+    long count;
+};
+
+void inode_index_init(struct inode_index *ii);
+void inode_index_add(struct inode_index *ii, dev_t dev, ino_t ino, const char *path);
+const char *inode_index_find(struct inode_index *ii, dev_t dev, ino_t ino);
+
+#endif // _INODE_INDEX_H_
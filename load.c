@@ -0,0 +1,695 @@
+#define _GNU_SOURCE // fmemopen()
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ftree.h"
+#include "hash.h"
+#include "mux.h"
+
+#ifndef PORT
+  #define PORT 30000
+#endif
+
+/*
+ * rcopy_load simulates many clients at once: every connection speaks the
+ * wire protocol directly, with no source tree behind it, and runs a
+ * closed loop of operations on its own directory of the server (a new
+ * request as soon as the previous one is answered). The content of each
+ * file is generated from a seed, so nothing is kept in memory and every
+ * file is new to the server's content index.
+ */
+#define DEFAULT_CONNECTIONS "1,10,100,500"
+// The server select()s on its clients, so it refuses connections whose
+// descriptor is past FD_SETSIZE; a few of its descriptors are its own.
+#define SERVER_MAX_CONNECTIONS (FD_SETSIZE - 16)
+#define DEFAULT_SECONDS 5
+#define DEFAULT_FILE_SIZE 4096
+#define DEFAULT_MIX "10,60,30"
+#define MAX_STEPS 16
+#define LOAD_FRAME_DATA 8192        // data frame size, keeps buffers small
+#define CONNECT_TIMEOUT_MS 10000
+#define DRAIN_TIMEOUT_MS 2000       // for the operations still running at the end
+
+// Operations, and the latencies that are reported
+#define OP_DIR 0        // REGDIR for the connection's directory
+#define OP_CHECK 1      // REGFILE for the last file written, unchanged
+#define OP_WRITE 2      // REGFILE for a new file, up to the SENDFILE answer
+#define OP_TRANSFER 3   // the TRANSFILE of a write, up to the server's OK
+#define NUM_OPS 4
+
+static const char *op_names[NUM_OPS] = {"regdir", "regfile", "new file", "transfile"};
+
+// Connection states
+#define CONN_CONNECTING 0
+#define CONN_READY 1        // nothing outstanding, once out is empty
+#define CONN_WAITING 2      // waiting for a response
+#define CONN_SENDING 3      // sending file data, then waiting for the response
+#define CONN_CLOSED 4
+
+/*
+ * One simulated client.
+ */
+struct load_conn {
+    int fd;
+    int state;
+    int id;
+    int setup;              // REGDIRs done: "load", then "load/cID"
+    int op;                 // the outstanding operation
+    long files;             // files written so far
+    struct request req;     // the outstanding request
+    uint64_t seed;          // of the file being written
+    char last_hash[HASH_SIZE]; // of the last file written
+    off_t offset;           // where the next data frame starts
+    off_t left;             // bytes of the file not sent yet
+    long window;            // bytes the server will still accept
+    long stream_window;     // what a transfer starts with, see mux.h
+    double sent_at;
+    char out[FRAME_HEADER_SIZE + LOAD_FRAME_DATA];
+    size_t out_len, out_off;
+    char in[FRAME_HEADER_SIZE + sizeof(int)];
+    size_t in_len;
+};
+
+/*
+ * Latencies of one kind of operation, in microseconds.
+ */
+struct latencies {
+    double *us;
+    long n, capacity;
+};
+
+/*
+ * Settings and counters of a run.
+ */
+struct load {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    long file_size;
+    int weights[3];         // of OP_DIR, OP_CHECK and OP_WRITE
+    uint64_t nonce;         // makes every run's content new
+    struct latencies lat[NUM_OPS];
+    long errors;            // ERROR responses
+    long closed;            // connections the server closed or reset
+    long bytes;             // file data the server has confirmed
+    char *scratch;          // file_size bytes, for hashing
+};
+
+/*
+ * This function returns the current value of the monotonic clock in
+ * nanoseconds.
+ */
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * This function takes a 64-bit value x as input and returns it mixed
+ * (splitmix64), as a cheap generator of synthetic content.
+ */
+static uint64_t mix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/*
+ * This function takes the seed of a file, an offset and a buffer buf of
+ * len bytes as inputs, and fills buf with the file's content at offset.
+ */
+static void fill(uint64_t seed, off_t offset, char *buf, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        off_t p = offset + i;
+        buf[i] = mix64(seed ^ (p >> 3)) >> ((p & 7) * 8);
+    }
+}
+
+static void add_latency(struct latencies *l, double us) {
+    if (l->n == l->capacity) {
+        l->capacity = l->capacity == 0 ? 4096 : l->capacity * 2;
+        l->us = realloc(l->us, l->capacity * sizeof(double));
+        if (l->us == NULL) {
+            perror("load: realloc");
+            exit(1);
+        }
+    }
+    l->us[l->n++] = us;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * This function takes sorted latencies l and a quantile q as inputs, and
+ * returns the latency that a fraction q of the operations stayed within.
+ */
+static double percentile(const struct latencies *l, double q) {
+    long i = (long)(q * l->n + 0.999999) - 1;
+    return l->us[i < 0 ? 0 : i];
+}
+
+/*
+ * This function takes a connection c, a stream, a frame type and a payload
+ * of length bytes as inputs, and appends the frame to c's output.
+ */
+static void queue_frame(struct load_conn *c, uint32_t stream, uint32_t type,
+                        const void *payload, uint32_t length) {
+    uint32_t header[3] = {htonl(stream), htonl(type), htonl(length)};
+    memcpy(c->out + c->out_len, header, FRAME_HEADER_SIZE);
+    memcpy(c->out + c->out_len + FRAME_HEADER_SIZE, payload, length);
+    c->out_len += FRAME_HEADER_SIZE + length;
+}
+
+/*
+ * This function takes a connection c and a request type as inputs, and
+ * queues c->req as a request of that type on stream.
+ */
+static void queue_request(struct load_conn *c, int stream, int type) {
+    char buf[REQUEST_SIZE];
+    struct request req = c->req;
+    req.type = htonl(type);
+    req.size = htobe64(req.size);
+    req.mtime = htobe64(NO_MTIME);
+    encode_request(&req, buf);
+    queue_frame(c, stream, FRAME_REQUEST, buf, REQUEST_SIZE);
+}
+
+/*
+ * This function takes the load ld and a connection c without anything
+ * outstanding and with nothing left in its output as inputs, picks c's
+ * next operation and queues its request.
+ */
+static void start_op(struct load *ld, struct load_conn *c) {
+    memset(&c->req, 0, sizeof(c->req));
+    if (c->setup < 2) {
+        c->op = OP_DIR;
+    } else {
+        int total = ld->weights[0] + ld->weights[1] + ld->weights[2];
+        int pick = rand() % total;
+        c->op = pick < ld->weights[0] ? OP_DIR :
+                pick < ld->weights[0] + ld->weights[1] ? OP_CHECK : OP_WRITE;
+        // Nothing to check before the first file.
+        if (c->op == OP_CHECK && c->files == 0) {
+            c->op = OP_WRITE;
+        }
+    }
+
+    if (c->op == OP_DIR) {
+        if (c->setup == 0) {
+            strcpy(c->req.path, "load");
+        } else {
+            snprintf(c->req.path, MAXPATH, "load/c%d", c->id);
+        }
+        c->req.mode = S_IFDIR | 0755;
+        queue_request(c, METADATA_STREAM, REGDIR);
+    } else {
+        long file = c->op == OP_CHECK ? c->files - 1 : c->files;
+        snprintf(c->req.path, MAXPATH, "load/c%d/f%ld", c->id, file);
+        c->req.mode = S_IFREG | 0644;
+        c->req.size = ld->file_size;
+        if (c->op == OP_WRITE) {
+            c->seed = mix64(ld->nonce ^ ((uint64_t)c->id << 32) ^ file);
+            fill(c->seed, 0, ld->scratch, ld->file_size);
+            // fmemopen() can't open an empty buffer, but /dev/null is empty.
+            char blank[BLOCKSIZE];
+            FILE *f = ld->file_size > 0 ? fmemopen(ld->scratch, ld->file_size, "rb")
+                                        : fopen("/dev/null", "rb");
+            if (f == NULL) {
+                perror("load: fmemopen");
+                exit(1);
+            }
+            memcpy(c->last_hash, hash(blank, f), HASH_SIZE);
+            fclose(f);
+        }
+        memcpy(c->req.hash, c->last_hash, HASH_SIZE);
+        queue_request(c, METADATA_STREAM, REGFILE);
+    }
+    c->state = CONN_WAITING;
+    c->sent_at = now_ns();
+}
+
+/*
+ * This function takes a connection c that is sending a file and has
+ * nothing else queued as input, and queues the next data frame if the
+ * server's window allows.
+ */
+static void queue_data(struct load_conn *c) {
+    if (c->left == 0 || c->window <= 0) {
+        return;
+    }
+    uint32_t length = c->left < LOAD_FRAME_DATA ? c->left : LOAD_FRAME_DATA;
+    if (length > c->window) {
+        length = c->window;
+    }
+    // Generated in place, right behind its header.
+    uint32_t header[3] = {htonl(1), htonl(FRAME_DATA), htonl(length)};
+    memcpy(c->out + c->out_len, header, FRAME_HEADER_SIZE);
+    fill(c->seed, c->offset, c->out + c->out_len + FRAME_HEADER_SIZE, length);
+    c->out_len += FRAME_HEADER_SIZE + length;
+    c->offset += length;
+    c->left -= length;
+    c->window -= length;
+}
+
+/*
+ * This function takes a connection c as input, and sends as much of its
+ * output as the socket takes without blocking, queueing more file data
+ * while it is sending a file.
+ * If the connection is still usable return 0, otherwise return -1.
+ */
+static int flush(struct load_conn *c) {
+    while (1) {
+        if (c->out_off == c->out_len) {
+            c->out_off = c->out_len = 0;
+            if (c->state != CONN_SENDING) {
+                return 0;
+            }
+            queue_data(c);
+            if (c->out_len == 0) {
+                return 0;
+            }
+        }
+        ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+        if (n == -1) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+        }
+        c->out_off += n;
+    }
+}
+
+/*
+ * This function takes the load ld, a connection c and a frame that c has
+ * received in full as inputs, and acts on it.
+ * If the frame makes sense return 0, otherwise return -1.
+ */
+static int handle_response(struct load *ld, struct load_conn *c,
+                           const struct frame_header *h, int value) {
+    if (h->type == FRAME_WINDOW && h->stream == METADATA_STREAM) {
+        if (value < c->stream_window) {
+            c->stream_window = value;
+        }
+        return 0;
+    }
+    if (h->type == FRAME_WINDOW && h->stream == 1) {
+        c->window += value;
+        return 0;
+    }
+    if (h->type != FRAME_RESPONSE || c->state == CONN_READY) {
+        return -1;
+    }
+    double now = now_ns();
+    int op = (c->state == CONN_SENDING) ? OP_TRANSFER : c->op;
+    add_latency(&ld->lat[op], (now - c->sent_at) / 1e3);
+
+    if (value == ERROR) {
+        ld->errors++;
+        // The server discards the rest of the file, but the frame that is
+        // partly sent has to be finished, or the next one would be read
+        // from its middle. No further frames are queued.
+        c->left = 0;
+    } else if (c->op == OP_DIR) {
+        c->setup += (c->setup < 2);
+    } else if (c->op == OP_WRITE && c->state == CONN_WAITING && value == SENDFILE) {
+        // The file data goes on a stream of its own.
+        queue_request(c, 1, TRANSFILE);
+        c->state = CONN_SENDING;
+        c->sent_at = now;
+        c->offset = 0;
+        c->left = ld->file_size;
+        c->window = c->stream_window;
+        return 0;
+    } else if (c->op == OP_WRITE) {
+        if (op == OP_TRANSFER) {
+            ld->bytes += ld->file_size;
+        }
+        c->files++;
+    }
+    c->state = CONN_READY;
+    return 0;
+}
+
+/*
+ * This function takes the load ld and a readable connection c as inputs,
+ * and handles the frames that have arrived.
+ * If the connection is still usable return 0, otherwise return -1.
+ */
+static int read_responses(struct load *ld, struct load_conn *c) {
+    while (1) {
+        ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+        if (n == 0) {
+            return -1;
+        }
+        if (n == -1) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+        }
+        c->in_len += n;
+        if (c->in_len < sizeof(c->in)) {
+            continue;
+        }
+        // The server only sends frames with an int as payload.
+        struct frame_header h;
+        decode_frame_header(c->in, &h);
+        int value;
+        memcpy(&value, c->in + FRAME_HEADER_SIZE, sizeof(int));
+        c->in_len = 0;
+        if (h.length != sizeof(int) || handle_response(ld, c, &h, ntohl(value)) == -1) {
+            return -1;
+        }
+    }
+}
+
+/*
+ * This function takes the load ld and a connection c as inputs, and
+ * starts connecting c to the server without blocking.
+ */
+static void start_connect(struct load *ld, struct load_conn *c) {
+    c->fd = socket(ld->addr.ss_family, SOCK_STREAM, 0);
+    if (c->fd == -1) {
+        perror("load: socket");
+        exit(1);
+    }
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+    if (ld->addr.ss_family != AF_UNIX) {
+        set_nodelay(c->fd);
+    }
+    c->state = CONN_CONNECTING;
+    // We don't announce a window, so the server uses the default at most.
+    c->stream_window = DEFAULT_STREAM_WINDOW;
+    if (connect(c->fd, (struct sockaddr *)&ld->addr, ld->addr_len) == 0) {
+        c->state = CONN_READY;
+    } else if (errno != EINPROGRESS && errno != EAGAIN) {
+        close(c->fd);
+        c->state = CONN_CLOSED;
+    }
+}
+
+/*
+ * This function takes the load ld, an array conns of n connections and a
+ * deadline (monotonic nanoseconds) as inputs, and drives the connections
+ * until the deadline. If more is 0, no new operation is started, and it
+ * returns early once nothing is outstanding anymore.
+ * It returns the number of connections that are still open.
+ */
+static int drive(struct load *ld, struct load_conn *conns, int n, double deadline, int more) {
+    struct pollfd *fds = malloc(n * sizeof(struct pollfd));
+    int *index = malloc(n * sizeof(int));
+    if (fds == NULL || index == NULL) {
+        perror("load: malloc");
+        exit(1);
+    }
+    int open_conns;
+    while (1) {
+        int nfds = 0, busy = 0;
+        open_conns = 0;
+        for (int i = 0; i < n; i++) {
+            struct load_conn *c = &conns[i];
+            if (c->state == CONN_CLOSED) {
+                continue;
+            }
+            open_conns++;
+            if (c->state == CONN_READY && c->out_len == 0 && more) {
+                start_op(ld, c);
+                if (flush(c) == -1) {
+                    close(c->fd);
+                    c->state = CONN_CLOSED;
+                    ld->closed++;
+                    continue;
+                }
+            }
+            if (c->state == CONN_READY && c->out_len == 0) {
+                continue;
+            }
+            busy++;
+            fds[nfds].fd = c->fd;
+            fds[nfds].events = POLLIN;
+            if (c->state == CONN_CONNECTING || c->out_len > 0 ||
+                (c->state == CONN_SENDING && c->left > 0 && c->window > 0)) {
+                fds[nfds].events |= POLLOUT;
+            }
+            index[nfds++] = i;
+        }
+        double now = now_ns();
+        if (now >= deadline || (!more && busy == 0)) {
+            break;
+        }
+        int ready = poll(fds, nfds, (deadline - now) / 1e6 + 1);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("load: poll");
+            exit(1);
+        }
+        for (int j = 0; j < nfds && ready > 0; j++) {
+            if (fds[j].revents == 0) {
+                continue;
+            }
+            ready--;
+            struct load_conn *c = &conns[index[j]];
+            int failed = 0;
+            if (c->state == CONN_CONNECTING) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0) {
+                    failed = 1;
+                } else if (fds[j].revents & POLLOUT) {
+                    c->state = CONN_READY;
+                }
+            } else {
+                if (fds[j].revents & (POLLIN | POLLERR | POLLHUP)) {
+                    failed = read_responses(ld, c) == -1;
+                }
+                if (!failed && (fds[j].revents & POLLOUT)) {
+                    failed = flush(c) == -1;
+                }
+            }
+            if (failed) {
+                close(c->fd);
+                c->state = CONN_CLOSED;
+                ld->closed++;
+            }
+        }
+    }
+    free(fds);
+    free(index);
+    return open_conns;
+}
+
+/*
+ * This function takes the load ld, the number of connections n and the
+ * number of seconds to run as inputs, runs one step of the load and
+ * reports it.
+ */
+static void run_step(struct load *ld, int n, int seconds) {
+    struct load_conn *conns = calloc(n, sizeof(struct load_conn));
+    if (conns == NULL) {
+        perror("load: calloc");
+        exit(1);
+    }
+    for (int i = 0; i < NUM_OPS; i++) {
+        ld->lat[i].n = 0;
+    }
+    ld->errors = ld->closed = ld->bytes = 0;
+    ld->nonce = mix64(now_ns());
+
+    // All connections are opened before the clock starts.
+    double t0 = now_ns();
+    for (int i = 0; i < n; i++) {
+        conns[i].id = i;
+        start_connect(ld, &conns[i]);
+    }
+    int connected = drive(ld, conns, n, t0 + CONNECT_TIMEOUT_MS * 1e6, 0);
+    for (int i = 0; i < n; i++) {
+        if (conns[i].state == CONN_CONNECTING) {
+            close(conns[i].fd);
+            conns[i].state = CONN_CLOSED;
+            connected--;
+        }
+    }
+    double connect_ms = (now_ns() - t0) / 1e6;
+    ld->closed = 0;
+
+    double start = now_ns();
+    drive(ld, conns, n, start + seconds * 1e9, 1);
+    double elapsed = (now_ns() - start) / 1e9;
+    drive(ld, conns, n, now_ns() + DRAIN_TIMEOUT_MS * 1e6, 0);
+    // A connection the server never got to (e.g. it was still waiting to be
+    // accepted) has no latencies to show for it, so count those separately.
+    int starved = 0;
+    for (int i = 0; i < n; i++) {
+        starved += (conns[i].setup == 0);
+        if (conns[i].state != CONN_CLOSED) {
+            close(conns[i].fd);
+        }
+    }
+    free(conns);
+
+    long ops = 0;
+    for (int i = 0; i < NUM_OPS; i++) {
+        ops += ld->lat[i].n;
+    }
+    printf("%d connections (%d connected in %.0f ms, %d never answered, %ld closed by the server): "
+           "%.0f responses/s, %.2f MB/s of file data, %ld errors\n",
+           n, connected, connect_ms, starved, ld->closed, ops / elapsed,
+           ld->bytes / elapsed / 1e6, ld->errors);
+    printf("  %-10s %10s %12s %12s %12s\n", "response", "count", "p50 us", "p99 us", "p999 us");
+    for (int i = 0; i < NUM_OPS; i++) {
+        struct latencies *l = &ld->lat[i];
+        if (l->n == 0) {
+            continue;
+        }
+        qsort(l->us, l->n, sizeof(double), compare_doubles);
+        printf("  %-10s %10ld %12.0f %12.0f %12.0f\n", op_names[i], l->n,
+               percentile(l, 0.5), percentile(l, 0.99), percentile(l, 0.999));
+    }
+    fflush(stdout);
+}
+
+/*
+ * This function takes the load ld and HOST (a host name or unix:PATH) as
+ * inputs, and stores the server's address in ld.
+ */
+static void resolve(struct load *ld, const char *host) {
+    memset(&ld->addr, 0, sizeof(ld->addr));
+    if (strncmp(host, LOCAL_PREFIX, strlen(LOCAL_PREFIX)) == 0) {
+        struct sockaddr_un *local = (struct sockaddr_un *)&ld->addr;
+        const char *path = host + strlen(LOCAL_PREFIX);
+        if (strlen(path) >= sizeof(local->sun_path)) {
+            fprintf(stderr, "load: socket path too long: %s\n", path);
+            exit(1);
+        }
+        local->sun_family = AF_UNIX;
+        strcpy(local->sun_path, path);
+        ld->addr_len = sizeof(*local);
+        return;
+    }
+    struct addrinfo hints, *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, &hints, &result) != 0) {
+        fprintf(stderr, "load: unknown host %s\n", host);
+        exit(1);
+    }
+    memcpy(&ld->addr, result->ai_addr, result->ai_addrlen);
+    ld->addr_len = result->ai_addrlen;
+    ((struct sockaddr_in *)&ld->addr)->sin_port = htons(PORT);
+    freeaddrinfo(result);
+}
+
+static void usage(void) {
+    printf("Usage: rcopy_load [-c CONNS] [-t SECONDS] [-s SIZE] [-m MIX] HOST\n");
+    printf("\t CONNS - Comma separated connection counts to step through (default %s);\n",
+           DEFAULT_CONNECTIONS);
+    printf("\t         the server accepts only about %d clients at once\n",
+           SERVER_MAX_CONNECTIONS);
+    printf("\t SECONDS - How long each step runs (default %d)\n", DEFAULT_SECONDS);
+    printf("\t SIZE - The size of every file written, e.g. 4K (default %d)\n", DEFAULT_FILE_SIZE);
+    printf("\t MIX - Weights of directory requests, checks of unchanged files and\n");
+    printf("\t       new files (which are then transferred) (default %s)\n", DEFAULT_MIX);
+    printf("\t HOST - The server, on this host: localhost, or unix:PATH for its local socket\n");
+}
+
+int main(int argc, char **argv) {
+    struct load ld;
+    memset(&ld, 0, sizeof(ld));
+    const char *conn_list = DEFAULT_CONNECTIONS, *mix = DEFAULT_MIX;
+    int seconds = DEFAULT_SECONDS;
+    ld.file_size = DEFAULT_FILE_SIZE;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:t:s:m:")) != -1) {
+        switch (opt) {
+            case 'c':
+                conn_list = optarg;
+                break;
+            case 't':
+                seconds = atoi(optarg);
+                break;
+            case 's': {
+                char *end;
+                ld.file_size = strtol(optarg, &end, 10);
+                if (*end == 'K' || *end == 'k') {
+                    ld.file_size <<= 10;
+                } else if (*end == 'M' || *end == 'm') {
+                    ld.file_size <<= 20;
+                }
+                break;
+            }
+            case 'm':
+                mix = optarg;
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+    if (argc - optind != 1 || seconds < 1 || ld.file_size < 0 || ld.file_size > INT32_MAX ||
+        sscanf(mix, "%d,%d,%d", &ld.weights[0], &ld.weights[1], &ld.weights[2]) != 3 ||
+        ld.weights[0] < 0 || ld.weights[1] < 0 || ld.weights[2] < 0 ||
+        ld.weights[0] + ld.weights[1] + ld.weights[2] == 0) {
+        usage();
+        return 1;
+    }
+    int steps[MAX_STEPS], num_steps = 0;
+    for (const char *p = conn_list; *p != '\0' && num_steps < MAX_STEPS; ) {
+        char *end;
+        steps[num_steps] = strtol(p, &end, 10);
+        if (end == p || steps[num_steps] < 1) {
+            usage();
+            return 1;
+        }
+        num_steps++;
+        p = (*end == ',') ? end + 1 : end;
+    }
+    resolve(&ld, argv[optind]);
+    ld.scratch = malloc(ld.file_size > 0 ? ld.file_size : 1);
+    if (ld.scratch == NULL) {
+        perror("load: malloc");
+        return 1;
+    }
+    srand(time(NULL));
+    signal(SIGPIPE, SIG_IGN);
+
+    // Every connection is a descriptor.
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    for (int i = 0; i < num_steps; i++) {
+        if (steps[i] + 16 > (long)limit.rlim_cur) {
+            fprintf(stderr, "load: only %ld descriptors allowed, skipping %d connections\n",
+                    (long)limit.rlim_cur, steps[i]);
+            continue;
+        }
+        if (steps[i] > SERVER_MAX_CONNECTIONS) {
+            printf("note: the server accepts only about %d clients at once, "
+                   "the rest of %d will never be answered\n", SERVER_MAX_CONNECTIONS, steps[i]);
+        }
+        run_step(&ld, steps[i], seconds);
+    }
+    return 0;
+}
@@ -0,0 +1,287 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "mux.h"
+
+/*
+ * This function takes a file descriptor fd, a buffer buf and its length len
+ * as inputs, and writes all of buf to fd, however many write() calls that
+ * takes. If it succeeds return 0, otherwise return -1 with errno set.
+ */
+int write_full(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * This function takes a file descriptor fd, a buffer buf and its length len
+ * as inputs, and fills buf from fd. If it succeeds return 0, otherwise
+ * return -1, with errno set to 0 if fd was closed before len bytes came.
+ */
+int read_full(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            errno = 0;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * This function takes a file descriptor fd, a stream, a frame type and a
+ * payload of length bytes as inputs, and writes them to fd as one frame.
+ * Header and payload go out in a single system call where possible.
+ * If it succeeds return 0, otherwise return -1 with errno set.
+ */
+int write_frame(int fd, uint32_t stream, uint32_t type, const void *payload, uint32_t length) {
+    uint32_t header[3] = {htonl(stream), htonl(type), htonl(length)};
+    struct iovec iov[2] = {
+        {header, FRAME_HEADER_SIZE},
+        {(void *)payload, length}
+    };
+    ssize_t n;
+    while ((n = writev(fd, iov, length > 0 ? 2 : 1)) == -1 && errno == EINTR);
+    if (n == -1) {
+        return -1;
+    }
+    // Finish a short write one piece at a time.
+    if (n < FRAME_HEADER_SIZE) {
+        if (write_full(fd, (char *)header + n, FRAME_HEADER_SIZE - n) == -1) {
+            return -1;
+        }
+        n = FRAME_HEADER_SIZE;
+    }
+    return write_full(fd, (const char *)payload + (n - FRAME_HEADER_SIZE),
+                      length - (n - FRAME_HEADER_SIZE));
+}
+
+/*
+ * This function is write_frame() for sockets, with flags for sendmsg()
+ * (e.g. MSG_MORE to let the kernel coalesce the frame with the next one).
+ */
+int send_frame(int fd, uint32_t stream, uint32_t type, const void *payload, uint32_t length, int flags) {
+    uint32_t header[3] = {htonl(stream), htonl(type), htonl(length)};
+    struct iovec iov[2] = {
+        {header, FRAME_HEADER_SIZE},
+        {(void *)payload, length}
+    };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = length > 0 ? 2 : 1;
+
+    // Unlike writev(), sendmsg() takes flags, so finish short sends here.
+    size_t left = FRAME_HEADER_SIZE + length;
+    while (left > 0) {
+        ssize_t n = sendmsg(fd, &msg, flags);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        left -= n;
+        while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/*
+ * This function takes a Unix domain socket fd, a stream and an open file
+ * file_fd as inputs, and sends a FRAME_FD frame on that stream with a
+ * copy of file_fd attached (SCM_RIGHTS), so that the peer can read the
+ * file itself. If it succeeds return 0, otherwise return -1 with errno set.
+ */
+int send_fd_frame(int fd, uint32_t stream, int file_fd) {
+    uint32_t header[3] = {htonl(stream), htonl(FRAME_FD), 0};
+    struct iovec iov = {header, FRAME_HEADER_SIZE};
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &file_fd, sizeof(int));
+
+    ssize_t n;
+    while ((n = sendmsg(fd, &msg, 0)) == -1 && errno == EINTR);
+    if (n == -1) {
+        return -1;
+    }
+    // The descriptor went with the first byte, the rest is plain data.
+    return write_full(fd, (char *)header + n, FRAME_HEADER_SIZE - n);
+}
+
+/*
+ * This function is read() for a connection that may carry descriptors
+ * (see send_fd_frame()). It takes a socket fd, a buffer buf and its
+ * length len, and an array fds with room for max_fds more descriptors
+ * after the first *num_fds as inputs. Descriptors that arrive are appended
+ * to fds, and those that don't fit are closed.
+ * It returns what read() would return.
+ */
+ssize_t read_with_fds(int fd, void *buf, size_t len, int *fds, int *num_fds, int max_fds) {
+    struct iovec iov = {buf, len};
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * 4)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n == -1) {
+        return -1;
+    }
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int count = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < count; i++) {
+            int passed;
+            memcpy(&passed, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+            if (*num_fds < max_fds) {
+                fds[(*num_fds)++] = passed;
+            } else {
+                close(passed);
+            }
+        }
+    }
+    return n;
+}
+
+/*
+ * This function is write_frame() for frames whose payload is a single int,
+ * which is sent in network byte order.
+ */
+int write_frame_int(int fd, uint32_t stream, uint32_t type, int value) {
+    int payload = htonl(value);
+    return write_frame(fd, stream, type, &payload, sizeof(int));
+}
+
+/*
+ * This function takes the FRAME_HEADER_SIZE bytes of a header in buf as
+ * input, and stores them in h in host byte order.
+ */
+void decode_frame_header(const char *buf, struct frame_header *h) {
+    uint32_t header[3];
+    memcpy(header, buf, FRAME_HEADER_SIZE);
+    h->stream = ntohl(header[0]);
+    h->type = ntohl(header[1]);
+    h->length = ntohl(header[2]);
+}
+
+/*
+ * This function takes a file descriptor fd as input, and reads the next
+ * frame header from it into h. The payload is left for the caller.
+ * If it succeeds return 0, otherwise return -1 as read_full() does.
+ */
+int read_frame_header(int fd, struct frame_header *h) {
+    char buf[FRAME_HEADER_SIZE];
+    if (read_full(fd, buf, FRAME_HEADER_SIZE) == -1) {
+        return -1;
+    }
+    decode_frame_header(buf, h);
+    return 0;
+}
+
+/*
+ * This function takes a file name under /proc/sys/net/ipv4 (tcp_wmem or
+ * tcp_rmem) as input, and returns the largest buffer TCP autotuning may
+ * grow a socket to, or 0 if that is unknown.
+ */
+static long autotune_limit(const char *name) {
+    char path[64];
+    long min, def, max;
+    snprintf(path, sizeof(path), "/proc/sys/net/ipv4/%s", name);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return 0;
+    }
+    if (fscanf(f, "%ld %ld %ld", &min, &def, &max) != 3) {
+        max = 0;
+    }
+    fclose(f);
+    return max;
+}
+
+/*
+ * This function takes a TCP socket fd, SO_SNDBUF or SO_RCVBUF as optname,
+ * and the number of bytes the socket must be able to hold as inputs, and
+ * sizes the socket's buffer for it. Setting a size switches off the
+ * kernel's autotuning, so that is only done if autotuning can't grow the
+ * buffer far enough by itself. For a listening socket it must be called
+ * before listen(), since the window scale is fixed by the handshake.
+ */
+void size_socket_buffer(int fd, int optname, long bytes) {
+    long limit = autotune_limit(optname == SO_SNDBUF ? "tcp_wmem" : "tcp_rmem");
+    if (limit == 0 || limit >= bytes) {
+        return;
+    }
+    int size = bytes;
+    if (setsockopt(fd, SOL_SOCKET, optname, &size, sizeof(size)) == -1) {
+        perror("setsockopt");
+    }
+}
+
+/*
+ * This function takes a TCP socket fd as input and switches off Nagle's
+ * algorithm, so that small frames (requests, responses, window updates)
+ * go out at once. Data frames are coalesced with MSG_MORE instead.
+ */
+void set_nodelay(int fd) {
+    int one = 1;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == -1) {
+        perror("setsockopt");
+    }
+}
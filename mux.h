@@ -0,0 +1,68 @@
+#ifndef _MUX_H_
+#define _MUX_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Everything on a connection is sent as frames, so that many logical
+ * streams can share it: stream 0 carries the REGFILE/REGDIR requests and
+ * their responses, and each file that is being transferred gets a stream
+ * of its own (1 to MAX_STREAMS) for its TRANSFILE request, data and
+ * result. Over a Unix domain socket, a file can be sent as a FRAME_FD
+ * instead of data: the open file itself is passed along, and the server
+ * copies it directly. Every frame starts with a header of three 32-bit
+ * integers in network byte order: stream, type, payload length.
+ */
+#define FRAME_HEADER_SIZE 12
+
+// Frame types
+#define FRAME_REQUEST 1     // payload: an encoded struct request (+ old path if moved)
+#define FRAME_RESPONSE 2    // payload: an int (OK, SENDFILE, ERROR, SKIPDIR)
+#define FRAME_DATA 3        // payload: the next bytes of a file
+#define FRAME_WINDOW 4      // payload: an int, more bytes the sender may send
+                            // (on stream 0: the window each stream starts with)
+#define FRAME_FD 5          // no payload, the file itself is attached (local only)
+#define FRAME_HOLE 6        // payload: a 64-bit length of zeros that isn't sent
+
+#define METADATA_STREAM 0
+#define MAX_STREAMS 8       // concurrent file transfers per connection
+#define MAX_FRAME_DATA 32768
+
+/*
+ * Flow control is per stream: the client may have at most a window of
+ * bytes of a file in flight, and the server hands out more with a
+ * FRAME_WINDOW once it has written data to disk. A slow or stuck file
+ * therefore can't fill the connection and starve the other streams.
+ * Both ends are configured with a window (DEFAULT_STREAM_WINDOW unless
+ * set otherwise), and each announces its own with a FRAME_WINDOW on the
+ * metadata stream as soon as the connection is up; the smaller one is
+ * used. An end that hasn't announced one is taken to use the default.
+ * A link with a large bandwidth-delay product needs a larger window.
+ */
+#define DEFAULT_STREAM_WINDOW (256 * 1024)
+#define MIN_STREAM_WINDOW MAX_FRAME_DATA
+#define MAX_STREAM_WINDOW (64 << 20)
+
+// The most file data that can be in flight on a connection with a window.
+#define CONNECTION_WINDOW(stream_window) ((long)MAX_STREAMS * (stream_window))
+
+struct frame_header {
+    uint32_t stream;
+    uint32_t type;
+    uint32_t length;
+};
+
+int write_full(int fd, const void *buf, size_t len);
+int read_full(int fd, void *buf, size_t len);
+int write_frame(int fd, uint32_t stream, uint32_t type, const void *payload, uint32_t length);
+int send_frame(int fd, uint32_t stream, uint32_t type, const void *payload, uint32_t length, int flags);
+int send_fd_frame(int fd, uint32_t stream, int file_fd);
+ssize_t read_with_fds(int fd, void *buf, size_t len, int *fds, int *num_fds, int max_fds);
+int write_frame_int(int fd, uint32_t stream, uint32_t type, int value);
+void decode_frame_header(const char *buf, struct frame_header *h);
+int read_frame_header(int fd, struct frame_header *h);
+void size_socket_buffer(int fd, int optname, long bytes);
+void set_nodelay(int fd);
+
+#endif // _MUX_H_
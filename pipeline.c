@@ -0,0 +1,527 @@
+#define _GNU_SOURCE // pipe2()
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "ftree.h"
+#include "pipeline.h"
+
+// How long the sender waits for a directory's digest before it sends the
+// directory without one. The sender keeps sending file data meanwhile, and
+// the hash threads work on the files below the directory.
+#define DIGEST_WAIT_MS 500
+
+static void complete(struct pipeline *p, int i);
+
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * This function is called with the lock held whenever an entry has been
+ * added or is done. It wakes the hash threads, and the sender if it is
+ * waiting (see pipeline_poll()).
+ */
+static void progress(struct pipeline *p) {
+    pthread_cond_broadcast(&p->progress);
+    if (p->sender_waiting) {
+        p->sender_waiting = 0;
+        if (write(p->wake_write_fd, "", 1) == -1 && errno != EAGAIN) {
+            perror("client: write");
+        }
+    }
+}
+
+/*
+ * This function is called with the lock held once everything below
+ * directory d is done. It computes the digest of d and completes it.
+ */
+static void finish_dir(struct pipeline *p, int d) {
+    struct sync_entry *dir = &p->entries[d];
+    if (dir->state != ENTRY_FAILED) {
+        int n = 0;
+        for (int c = dir->first_child; c != -1; c = p->entries[c].next_sibling) {
+            n++;
+        }
+        struct merkle_child *children = malloc((n + 1) * sizeof(struct merkle_child));
+        if (children == NULL) {
+            perror("client: malloc");
+            exit(1);
+        }
+        n = 0;
+        for (int c = dir->first_child; c != -1; c = p->entries[c].next_sibling) {
+            children[n].name = strrchr(p->entries[c].path, '/') + 1;
+            children[n].mode = p->entries[c].mode;
+            children[n].size = p->entries[c].size;
+            children[n].hash = p->entries[c].hash;
+            n++;
+        }
+        merkle_digest(dir->hash, children, n);
+        free(children);
+        dir->state = ENTRY_READY;
+    }
+    complete(p, d);
+}
+
+/*
+ * This function is called with the lock held once entry i is done, i.e.
+ * its hash or digest is known (or known to be unavailable). If it was the
+ * last thing its parent directory was waiting for, the parent is finished
+ * too, which may in turn finish the grandparent, and so on.
+ */
+static void complete(struct pipeline *p, int i) {
+    int parent = p->entries[i].parent;
+    if (parent < 0) {
+        return;
+    }
+    // A directory can only be summarized if everything below it can.
+    if (p->entries[i].state == ENTRY_FAILED || p->entries[i].state == ENTRY_UNHASHED) {
+        p->entries[parent].state = ENTRY_FAILED;
+    }
+    if (--p->entries[parent].pending == 0) {
+        finish_dir(p, parent);
+    }
+}
+
+/*
+ * This function appends path (which it takes over) with metadata st to the
+ * list of entries, as a child of entry parent. If an earlier sync already
+ * hashed the file and it hasn't changed since, the hash is reused. Returns
+ * the index of the new entry.
+ */
+static int add_entry(struct pipeline *p, char *path, int parent, const struct stat *st) {
+    pthread_mutex_lock(&p->lock);
+    if (p->num_entries == p->capacity) {
+        p->capacity = p->capacity == 0 ? 1024 : p->capacity * 2;
+        p->entries = realloc(p->entries, p->capacity * sizeof(struct sync_entry));
+        if (p->entries == NULL) {
+            perror("client: realloc");
+            exit(1);
+        }
+    }
+    int i = p->num_entries++;
+    struct sync_entry *e = &p->entries[i];
+    memset(e, 0, sizeof(*e));
+    e->path = path;
+    e->rel_path = path + p->prefix_len;
+    e->mode = st->st_mode;
+    e->size = st->st_size;
+    e->mtime = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->nlink = st->st_nlink;
+    e->parent = parent;
+    e->first_child = -1;
+    e->next_sibling = -1;
+    e->state = ENTRY_SCANNED;
+    // A directory isn't done before its listing is.
+    e->pending = S_ISDIR(st->st_mode) ? 1 : 0;
+    if (parent >= 0) {
+        e->next_sibling = p->entries[parent].first_child;
+        p->entries[parent].first_child = i;
+        p->entries[parent].pending++;
+        e->skip = p->entries[parent].skip;
+    }
+
+    struct tree_entry *cached = tree_index_update(p->cache, path, st);
+    if (S_ISREG(st->st_mode) && (cached->flags & HASH_VALID)) {
+        memcpy(e->hash, cached->hash, HASH_SIZE);
+        e->state = ENTRY_READY;
+        complete(p, i);
+    } else if (S_ISREG(st->st_mode) && p->on_demand) {
+        e->state = ENTRY_UNHASHED;
+        complete(p, i);
+    }
+    progress(p);
+    pthread_mutex_unlock(&p->lock);
+    return i;
+}
+
+/*
+ * This function adds every entry below directory i, depth first.
+ * Hidden entries and links are ignored, like they always have been.
+ */
+static void scan_dir(struct pipeline *p, int i) {
+    pthread_mutex_lock(&p->lock);
+    const char *dir = p->entries[i].path; /* never moves, unlike the entry */
+    pthread_mutex_unlock(&p->lock);
+
+    DIR *dirp = opendir(dir);
+    if (dirp == NULL) {
+        pthread_mutex_lock(&p->lock);
+        p->entries[i].error = errno;
+        p->entries[i].state = ENTRY_FAILED;
+        if (--p->entries[i].pending == 0) {
+            finish_dir(p, i);
+        }
+        progress(p);
+        pthread_mutex_unlock(&p->lock);
+        return;
+    }
+    struct dirent *dp;
+    while ((dp = readdir(dirp)) != NULL) {
+        if (dp->d_name[0] == '.') {
+            continue;
+        }
+        char *child = generate_path(dir, dp->d_name);
+        struct stat st;
+        if (lstat(child, &st) == -1) {
+            perror("client: lstat");
+            free(child);
+            pthread_mutex_lock(&p->lock);
+            p->num_errors++;
+            pthread_mutex_unlock(&p->lock);
+            continue;
+        }
+        if (S_ISLNK(st.st_mode)) {
+            free(child);
+            continue;
+        }
+        if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+            fprintf(stderr, "File type error!\n");
+            fprintf(stderr, "ERROR: %s\n", child + p->prefix_len);
+            free(child);
+            pthread_mutex_lock(&p->lock);
+            p->num_errors++;
+            pthread_mutex_unlock(&p->lock);
+            continue;
+        }
+        int c = add_entry(p, child, i, &st);
+        if (S_ISDIR(st.st_mode)) {
+            scan_dir(p, c);
+        }
+    }
+    closedir(dirp);
+
+    pthread_mutex_lock(&p->lock);
+    if (--p->entries[i].pending == 0) {
+        finish_dir(p, i);
+    }
+    progress(p);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void *scan_thread(void *arg) {
+    struct pipeline *p = arg;
+    struct stat st;
+    char *root = strdup(p->root);
+
+    if (lstat(root, &st) == -1) {
+        perror("client: lstat");
+        free(root);
+        pthread_mutex_lock(&p->lock);
+        p->num_errors++;
+    } else if (S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)) {
+        int i = add_entry(p, root, -1, &st);
+        if (S_ISDIR(st.st_mode)) {
+            scan_dir(p, i);
+        }
+        pthread_mutex_lock(&p->lock);
+    } else {
+        // Links are ignored, other types can't be sent.
+        if (!S_ISLNK(st.st_mode)) {
+            fprintf(stderr, "File type error!\n");
+            p->num_errors++;
+        }
+        free(root);
+        pthread_mutex_lock(&p->lock);
+    }
+    p->scan_done = 1;
+    progress(p);
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/*
+ * This function hashes the file at path into hash_val. If it succeeds
+ * return 0, otherwise return the errno of the failure.
+ */
+static int hash_file(const char *path, char *hash_val) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return errno;
+    }
+    posix_fadvise(fileno(f), 0, 0, POSIX_FADV_SEQUENTIAL);
+    hash(hash_val, f);
+    int err = ferror(f) ? EIO : 0;
+    fclose(f);
+    return err;
+}
+
+/*
+ * This function asks the kernel to start reading the file at path, so
+ * that it is (at least partly) cached by the time it gets hashed.
+ */
+static void read_ahead(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd != -1) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        close(fd);
+    }
+}
+
+static void *hash_thread(void *arg) {
+    struct pipeline *p = arg;
+    pthread_mutex_lock(&p->lock);
+    while (1) {
+        // Wanted files first, since a transfer is waiting for each.
+        int i = -1;
+        if (p->next_wanted < p->num_wanted) {
+            i = p->wanted[p->next_wanted++];
+        } else {
+            // Nothing in a subtree the sender has skipped is sent, so
+            // its files aren't read either.
+            while (p->next_to_hash < p->num_entries &&
+                   (!S_ISREG(p->entries[p->next_to_hash].mode) ||
+                    p->entries[p->next_to_hash].state != ENTRY_SCANNED ||
+                    p->entries[p->next_to_hash].skip)) {
+                p->next_to_hash++;
+            }
+            if (p->next_to_hash < p->num_entries) {
+                i = p->next_to_hash++;
+            }
+        }
+        if (i == -1) {
+            // On demand, files may be wanted until the sync is over.
+            if (p->scan_done && (!p->on_demand || p->finishing)) {
+                break;
+            }
+            pthread_cond_wait(&p->progress, &p->lock);
+            continue;
+        }
+
+        int wanted = (p->entries[i].state == ENTRY_WANTED);
+        p->entries[i].state = ENTRY_HASHING;
+        const char *path = p->entries[i].path;
+        // Find the file that will be hashed after this one.
+        const char *next = NULL;
+        if (p->next_wanted < p->num_wanted) {
+            struct sync_entry *n = &p->entries[p->wanted[p->next_wanted]];
+            next = n->size > 0 ? n->path : NULL;
+        }
+        for (int j = p->next_to_hash; next == NULL && j < p->num_entries; j++) {
+            if (S_ISREG(p->entries[j].mode) && p->entries[j].state == ENTRY_SCANNED &&
+                !p->entries[j].skip) {
+                next = p->entries[j].size > 0 ? p->entries[j].path : NULL;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&p->lock);
+
+        if (next != NULL) {
+            read_ahead(next);
+        }
+        char hash_val[BLOCKSIZE];
+        int err = hash_file(path, hash_val);
+
+        pthread_mutex_lock(&p->lock);
+        struct sync_entry *e = &p->entries[i];
+        if (err != 0) {
+            e->error = err;
+            e->state = ENTRY_FAILED;
+        } else {
+            memcpy(e->hash, hash_val, HASH_SIZE);
+            e->state = ENTRY_READY;
+            struct tree_entry *cached = tree_index_find(p->cache, path);
+            if (cached != NULL) {
+                tree_index_set_hash(cached, hash_val);
+            }
+        }
+        // A wanted file's directory has been done with already.
+        if (!wanted) {
+            complete(p, i);
+        }
+        progress(p);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/*
+ * This function starts the pipeline for the absolute path abs_src. The
+ * first prefix_len bytes of every path are stripped to get the path on
+ * the server. cache keeps hashes between syncs, and num_hashers is the
+ * number of hash threads. With on_demand (stat-only mode), files that
+ * aren't in the cache are left unhashed until pipeline_want_hash().
+ */
+void pipeline_start(struct pipeline *p, const char *abs_src, size_t prefix_len,
+                    struct tree_index *cache, int num_hashers, int on_demand) {
+    memset(p, 0, sizeof(*p));
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->progress, NULL);
+    p->prefix_len = prefix_len;
+    p->cache = cache;
+    p->digest_wait = -1;
+
+    p->root = abs_src;
+    // The scan needs to know whether files will be hashed.
+    p->num_hashers = num_hashers;
+    p->on_demand = on_demand;
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+        perror("client: pipe2");
+        exit(1);
+    }
+    p->wake_fd = fds[0];
+    p->wake_write_fd = fds[1];
+
+    if (pthread_create(&p->scanner, NULL, scan_thread, p) != 0) {
+        fprintf(stderr, "client: pthread_create failed\n");
+        exit(1);
+    }
+    p->hashers = malloc(num_hashers * sizeof(pthread_t));
+    for (int i = 0; i < num_hashers; i++) {
+        if (p->hashers == NULL || pthread_create(&p->hashers[i], NULL, hash_thread, p) != 0) {
+            fprintf(stderr, "client: pthread_create failed\n");
+            exit(1);
+        }
+    }
+}
+
+/*
+ * This function checks whether entry i can be sent, and if so copies it
+ * to entry. A file can be sent once it is hashed. A directory is sent
+ * once its digest is ready, so that an unchanged subtree is skipped in one
+ * round trip, or once it is known that there won't be one (e.g. a file
+ * below can't be read). So that a large subtree doesn't hold back the
+ * requests after it until all of it is hashed, a directory is sent
+ * without its digest DIGEST_WAIT_MS after the sender first asked for it.
+ *
+ * Returns 0, or -1 if there is no entry i because the scan is over. If
+ * entry i isn't ready yet, it returns 1: p->wake_fd becomes readable once
+ * there is progress, and timeout is set to how long to wait at most in
+ * ms, or -1 to wait for progress only.
+ */
+int pipeline_poll(struct pipeline *p, int i, struct sync_entry *entry, int *timeout) {
+    pthread_mutex_lock(&p->lock);
+    int result = 1;
+    *timeout = -1;
+    if (i < p->num_entries) {
+        struct sync_entry *e = &p->entries[i];
+        if (e->skip || e->state == ENTRY_READY || e->state == ENTRY_FAILED ||
+            e->state == ENTRY_UNHASHED) {
+            result = 0;
+        } else if (S_ISDIR(e->mode)) {
+            long now = now_ms();
+            if (p->digest_wait != i) {
+                p->digest_wait = i;
+                p->digest_deadline = now + DIGEST_WAIT_MS;
+            }
+            if (now >= p->digest_deadline) {
+                result = 0;
+            } else {
+                *timeout = (int)(p->digest_deadline - now);
+            }
+        }
+        if (result == 0) {
+            *entry = *e;
+        }
+    } else if (p->scan_done) {
+        result = -1;
+    }
+    if (result == 1) {
+        p->sender_waiting = 1;
+    }
+    pthread_mutex_unlock(&p->lock);
+    return result;
+}
+
+/*
+ * This function marks entry i and everything below it as not to be sent,
+ * and so not to be hashed either.
+ */
+void pipeline_skip(struct pipeline *p, int i) {
+    pthread_mutex_lock(&p->lock);
+    if (i >= p->num_entries) {
+        pthread_mutex_unlock(&p->lock);
+        return;
+    }
+    p->entries[i].skip = 1;
+    // In scan order, the subtree of i is the entries after it whose parent
+    // is i or comes after it. Entries the scan adds later inherit skip.
+    for (int j = i + 1; j < p->num_entries && p->entries[j].parent >= i; j++) {
+        p->entries[j].skip = 1;
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * This function asks the hash threads to hash the unhashed file entry i,
+ * because it is going to be sent. Once it is hashed (or has failed),
+ * p->wake_fd becomes readable, and pipeline_wanted_hash() has the hash.
+ */
+void pipeline_want_hash(struct pipeline *p, int i) {
+    pthread_mutex_lock(&p->lock);
+    if (p->entries[i].state == ENTRY_UNHASHED) {
+        if (p->num_wanted == p->wanted_capacity) {
+            p->wanted_capacity = p->wanted_capacity == 0 ? 64 : p->wanted_capacity * 2;
+            p->wanted = realloc(p->wanted, p->wanted_capacity * sizeof(int));
+            if (p->wanted == NULL) {
+                perror("client: realloc");
+                exit(1);
+            }
+        }
+        p->wanted[p->num_wanted++] = i;
+        p->entries[i].state = ENTRY_WANTED;
+        pthread_cond_broadcast(&p->progress);
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * This function takes the file entry i passed to pipeline_want_hash() as
+ * input. If it has been hashed, it copies the hash to hash_val and returns
+ * 0. It returns -1 if it is still waiting to be hashed (p->wake_fd becomes
+ * readable once there is progress), or the errno of the failure if it
+ * couldn't be.
+ */
+int pipeline_wanted_hash(struct pipeline *p, int i, char *hash_val) {
+    pthread_mutex_lock(&p->lock);
+    struct sync_entry *e = &p->entries[i];
+    int result = -1;
+    if (e->state == ENTRY_READY) {
+        memcpy(hash_val, e->hash, HASH_SIZE);
+        result = 0;
+    } else if (e->state == ENTRY_FAILED) {
+        result = e->error;
+    } else {
+        p->sender_waiting = 1;
+    }
+    pthread_mutex_unlock(&p->lock);
+    return result;
+}
+
+/*
+ * This function waits for the threads of the pipeline and frees it.
+ * Returns the number of entries the scan had to leave out due to errors.
+ */
+int pipeline_finish(struct pipeline *p) {
+    pthread_mutex_lock(&p->lock);
+    p->finishing = 1;
+    pthread_cond_broadcast(&p->progress);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->scanner, NULL);
+    for (int i = 0; i < p->num_hashers; i++) {
+        pthread_join(p->hashers[i], NULL);
+    }
+    for (int i = 0; i < p->num_entries; i++) {
+        free(p->entries[i].path);
+    }
+    free(p->entries);
+    free(p->hashers);
+    free(p->wanted);
+    close(p->wake_fd);
+    close(p->wake_write_fd);
+    p->entries = NULL;
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->progress);
+    return p->num_errors;
+}
@@ -0,0 +1,82 @@
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "hash.h"
+#include "tree_index.h"
+
+// Entry states
+#define ENTRY_SCANNED 0     // waiting for its hash (files) or digest (dirs)
+#define ENTRY_HASHING 1     // a hash thread is working on it
+#define ENTRY_READY 2       // hash holds the content hash or Merkle digest
+#define ENTRY_FAILED 3      // the hash or digest couldn't be computed
+#define ENTRY_UNHASHED 4    // stat-only: files are only hashed if they are sent
+#define ENTRY_WANTED 5      // stat-only: to be sent, waiting for a hash thread
+
+/*
+ * One file or directory of the source, in the order the scan found it
+ * (pre-order, so a directory always comes before everything below it).
+ */
+struct sync_entry {
+    char *path;             // absolute path on the client
+    char *rel_path;         // path on the server, relative to its dest
+    mode_t mode;
+    off_t size;
+    int64_t mtime;          // nanoseconds since the epoch
+    dev_t dev;              // identity of the file, to recognize moves
+    ino_t ino;
+    nlink_t nlink;
+    int parent;             // index of the parent entry, -1 for SRC itself
+    int first_child;
+    int next_sibling;
+    int pending;            // dirs: children (and the listing) not done yet
+    int state;
+    int error;              // errno of a failed open, 0 if none
+    int skip;               // set by the sender: don't send (or hash) this subtree
+    char hash[HASH_SIZE];
+};
+
+/*
+ * The client's staged pipeline: one thread scans the source, a pool of
+ * threads hashes files (and completes directory digests bottom-up), and
+ * the sender consumes entries in scan order as they become ready. The
+ * sender never waits on the lock's condition, but polls wake_fd next to
+ * its sockets, so that file data keeps flowing while it waits. All fields
+ * are protected by lock.
+ */
+struct pipeline {
+    pthread_mutex_t lock;
+    pthread_cond_t progress;    // broadcast whenever anything changes
+    const char *root;           // absolute path of SRC
+    struct sync_entry *entries;
+    int num_entries, capacity;
+    int scan_done;
+    int next_to_hash;           // hash threads take files in scan order
+    int on_demand;              // stat-only: only hash files that are wanted
+    int *wanted;                // files to hash on demand, first come first served
+    int num_wanted, wanted_capacity, next_wanted;
+    int finishing;              // no more files will be wanted
+    int wake_fd;                // readable once what the sender waits for may be done
+    int wake_write_fd;
+    int sender_waiting;         // the sender has to be woken on progress
+    int digest_wait;            // the directory the sender waits for, or -1
+    long digest_deadline;       // when it is sent without its digest, in ms
+    int num_errors;             // entries the scan had to leave out
+    size_t prefix_len;          // strip this much of a path for rel_path
+    struct tree_index *cache;   // hashes from earlier syncs
+    pthread_t scanner;
+    pthread_t *hashers;
+    int num_hashers;
+};
+
+void pipeline_start(struct pipeline *p, const char *abs_src, size_t prefix_len,
+                    struct tree_index *cache, int num_hashers, int on_demand);
+int pipeline_poll(struct pipeline *p, int i, struct sync_entry *entry, int *timeout);
+void pipeline_skip(struct pipeline *p, int i);
+void pipeline_want_hash(struct pipeline *p, int i);
+int pipeline_wanted_hash(struct pipeline *p, int i, char *hash_val);
+int pipeline_finish(struct pipeline *p);
+
+#endif // _PIPELINE_H_
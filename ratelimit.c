@@ -0,0 +1,61 @@
+#include "ratelimit.h"
+#include "mux.h"
+
+// How much sending may be saved up while idle, in seconds of rate.
+#define BURST_SECONDS 0.05
+
+/*
+ * This function takes a token bucket tb and its rate in bytes per second
+ * (0 for no limit) as inputs, and initializes tb full.
+ */
+void token_bucket_init(struct token_bucket *tb, double rate) {
+    tb->rate = rate;
+    // A burst of less than a frame would stall on every frame.
+    tb->burst = rate * BURST_SECONDS;
+    if (tb->burst < MAX_FRAME_DATA) {
+        tb->burst = MAX_FRAME_DATA;
+    }
+    tb->tokens = tb->burst;
+    clock_gettime(CLOCK_MONOTONIC, &tb->last);
+}
+
+/*
+ * This function takes a token bucket tb as input and adds the tokens that
+ * have accrued since it was last brought up to date.
+ */
+static void refill(struct token_bucket *tb) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - tb->last.tv_sec) + (now.tv_nsec - tb->last.tv_nsec) / 1e9;
+    tb->last = now;
+    tb->tokens += elapsed * tb->rate;
+    if (tb->tokens > tb->burst) {
+        tb->tokens = tb->burst;
+    }
+}
+
+/*
+ * This function takes a token bucket tb as input, and returns 0 if data
+ * may be sent now, or otherwise how many milliseconds to wait until then.
+ */
+int token_bucket_wait(struct token_bucket *tb) {
+    if (tb->rate <= 0) {
+        return 0;
+    }
+    refill(tb);
+    if (tb->tokens > 0) {
+        return 0;
+    }
+    // Round up, so that the bucket has refilled once the wait is over.
+    return (int)(-tb->tokens * 1000 / tb->rate) + 1;
+}
+
+/*
+ * This function takes a token bucket tb and the number of bytes that were
+ * sent as inputs, and takes that many tokens.
+ */
+void token_bucket_take(struct token_bucket *tb, long bytes) {
+    if (tb->rate > 0) {
+        tb->tokens -= bytes;
+    }
+}
@@ -0,0 +1,23 @@
+#ifndef _RATELIMIT_H_
+#define _RATELIMIT_H_
+
+#include <time.h>
+
+/*
+ * A token bucket for limiting how fast data is sent: it fills up at rate
+ * bytes per second, to at most burst bytes, and every byte sent takes a
+ * token. A send may overdraw the bucket, so that a frame never has to be
+ * split to fit; the next one then waits until the debt is paid off.
+ */
+struct token_bucket {
+    double rate;            // bytes per second, 0 for no limit
+    double burst;           // the most tokens that can be saved up
+    double tokens;          // may be negative after an overdraft
+    struct timespec last;   // when tokens was last brought up to date
+};
+
+void token_bucket_init(struct token_bucket *tb, double rate);
+int token_bucket_wait(struct token_bucket *tb);
+void token_bucket_take(struct token_bucket *tb, long bytes);
+
+#endif // _RATELIMIT_H_
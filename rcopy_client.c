@@ -1,21 +1,138 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "ftree.h"
+#include "mux.h"
 
 
 #ifndef PORT
   #define PORT 30000
 #endif
 
+/*
+ * This function takes a rate such as 500K or 10M (bytes per second), or a
+ * size in bytes, as input and returns its value, or -1 if it is malformed.
+ */
+static long parse_rate(const char *str) {
+    char *end;
+    long value = strtol(str, &end, 10);
+    if (end == str || value <= 0) {
+        return -1;
+    }
+    switch (*end) {
+        case '\0': return value;
+        case 'K': case 'k': return value << 10;
+        case 'M': case 'm': return value << 20;
+        case 'G': case 'g': return value << 30;
+        default: return -1;
+    }
+}
+
+static void usage(void) {
+    printf("Usage: rcopy_client [-w] [-j THREADS] [-z] [-s] [-o ORDER] [-p PATTERN]... [-r RATE] [-R RATE]\n");
+    printf("\t                   [-W BYTES] SRC HOST [HOST...]\n");
+    printf("\t -w - Keep running and send changes to SRC as they happen; files moved\n");
+    printf("\t      within SRC are then moved on the server instead of sent again\n");
+    printf("\t -j THREADS - Hash files with THREADS threads (default: one per CPU)\n");
+    printf("\t -z - Send file data with MSG_ZEROCOPY (for fast links)\n");
+    printf("\t -s - Stat-only: take files with the same size and mtime as unchanged,\n");
+    printf("\t      and only hash the files that are sent\n");
+    printf("\t -o ORDER - Send the files the server asks for in scan order (scan, the default),\n");
+    printf("\t            or the smallest first (smallest)\n");
+    printf("\t -p PATTERN - Send files whose path matches PATTERN first; may be repeated,\n");
+    printf("\t              earlier patterns go first\n");
+    printf("\t -r RATE - Send at most RATE bytes/s of file data in total, e.g. 10M\n");
+    printf("\t -R RATE - Send at most RATE bytes/s of file data to each HOST\n");
+    printf("\t -W BYTES - Have at most BYTES of each file in flight, or less if the server\n");
+    printf("\t            says so; raise it for links with a high bandwidth-delay product\n");
+    printf("\t            (default %dK, at most %dM)\n", DEFAULT_STREAM_WINDOW >> 10,
+           MAX_STREAM_WINDOW >> 20);
+    printf("\t SRC - The file or directory to copy to the server\n");
+    printf("\t HOST - The hostname of the server; with several, SRC is read once\n");
+    printf("\t        and copied to all of them\n");
+}
+
 int main(int argc, char **argv) {
-    if (argc != 3) {
-        printf("Usage: rcopy_client SRC HOST\n");
-        printf("\t SRC - The file or directory to copy to the server\n");
-        printf("\t HOST - The hostname of the server\n");
+    int watch = 0;
+    int opt;
+    client_options.stream_window = DEFAULT_STREAM_WINDOW;
+    while ((opt = getopt(argc, argv, "wj:zso:p:r:R:W:")) != -1) {
+        switch (opt) {
+            case 'w':
+                watch = 1;
+                break;
+            case 'z':
+                client_options.zerocopy = 1;
+                break;
+            case 's':
+                client_options.stat_only = 1;
+                break;
+            case 'o':
+                if (strcmp(optarg, "scan") == 0) {
+                    client_options.order = ORDER_SCAN;
+                } else if (strcmp(optarg, "smallest") == 0) {
+                    client_options.order = ORDER_SMALLEST;
+                } else {
+                    usage();
+                    return 1;
+                }
+                break;
+            case 'p':
+                client_options.priority = realloc(client_options.priority,
+                    (client_options.num_priority + 1) * sizeof(char *));
+                if (client_options.priority == NULL) {
+                    perror("realloc");
+                    return 1;
+                }
+                client_options.priority[client_options.num_priority++] = optarg;
+                break;
+            case 'r':
+            case 'R':
+                if (parse_rate(optarg) == -1) {
+                    usage();
+                    return 1;
+                }
+                if (opt == 'r') {
+                    client_options.rate = parse_rate(optarg);
+                } else {
+                    client_options.target_rate = parse_rate(optarg);
+                }
+                break;
+            case 'W':
+                client_options.stream_window = parse_rate(optarg);
+                if (client_options.stream_window < MIN_STREAM_WINDOW ||
+                    client_options.stream_window > MAX_STREAM_WINDOW) {
+                    usage();
+                    return 1;
+                }
+                break;
+            case 'j':
+                client_options.hash_threads = atoi(optarg);
+                if (client_options.hash_threads <= 0) {
+                    usage();
+                    return 1;
+                }
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+    int num_hosts = argc - optind - 1;
+    if (num_hosts < 1 || num_hosts > MAX_TARGETS) {
+        usage();
         return 1;
     }
+    char *source = argv[optind];
+    char **hosts = argv + optind + 1;
+
+    if (watch) {
+        // Only returns if watching fails.
+        return rcopy_watch(source, hosts, num_hosts, PORT);
+    }
 
-    if (rcopy_client(argv[1], argv[2], PORT) != 0) {
+    if (rcopy_client(source, hosts, num_hosts, PORT, 1) != 0) {
         printf("Errors encountered during copy\n");
         return 1;
     } else {
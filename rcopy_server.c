@@ -5,18 +5,124 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <limits.h>
 
 #include "ftree.h"
+#include "mux.h"
 
 #ifndef PORT
   #define PORT 30000
 #endif
 
-int main(int argc, char **argv) {
+/*
+ * This function takes a size such as 64, 512K or 32M as input and returns
+ * the number of bytes it represents, or -1 if it is malformed.
+ */
+static long parse_size(const char *str) {
+    char *end;
+    long value = strtol(str, &end, 10);
+    if (end == str || value <= 0) {
+        return -1;
+    }
+    switch (*end) {
+        case '\0': return value;
+        case 'K': case 'k': return value << 10;
+        case 'M': case 'm': return value << 20;
+        case 'G': case 'g': return value << 30;
+        default: return -1;
+    }
+}
 
-    if(argc != 2) {
-        printf("Usage: rcopy_server PATH_PREFIX\n");
-        printf("\t PATH_PREFIX - The path on the server used as the path prefix for the destination\n");
+static void usage(void) {
+    printf("Usage: rcopy_server [-l unix:PATH] [-d none|per-file|group] [-t FILES] [-b BYTES]\n");
+    printf("\t                   [-T FILES] [-B BYTES] [-W BYTES] PATH_PREFIX\n");
+    printf("\t -l unix:PATH - Also accept clients on this host through a Unix domain socket\n");
+    printf("\t -d MODE - Sync files to disk before acknowledging them: not at all (none, the default),\n");
+    printf("\t           one by one (per-file), or in batches with one sync each (group)\n");
+    printf("\t -t FILES - Receive at most FILES files at once from each client address (default %d)\n",
+           DEFAULT_CLIENT_TRANSFERS);
+    printf("\t -b BYTES - Let each client address have at most BYTES of file data in flight (default %ldM)\n",
+           DEFAULT_CLIENT_IN_FLIGHT >> 20);
+    printf("\t -T FILES, -B BYTES - The same limits for all clients together (default %d, %ldM)\n",
+           DEFAULT_MAX_TRANSFERS, DEFAULT_MAX_IN_FLIGHT >> 20);
+    printf("\t -W BYTES - Let a client have at most BYTES of each file in flight, or less if\n");
+    printf("\t            it asks for less (default %dK, at most %dM)\n", DEFAULT_STREAM_WINDOW >> 10,
+           MAX_STREAM_WINDOW >> 20);
+    printf("\t PATH_PREFIX - The path on the server used as the path prefix for the destination\n");
+}
+
+int main(int argc, char **argv) {
+    server_options.client_transfers = DEFAULT_CLIENT_TRANSFERS;
+    server_options.client_in_flight = DEFAULT_CLIENT_IN_FLIGHT;
+    server_options.max_transfers = DEFAULT_MAX_TRANSFERS;
+    server_options.max_in_flight = DEFAULT_MAX_IN_FLIGHT;
+    server_options.stream_window = DEFAULT_STREAM_WINDOW;
+    int opt;
+    long value;
+    while ((opt = getopt(argc, argv, "l:d:t:b:T:B:W:")) != -1) {
+        switch (opt) {
+            case 'l':
+                if (strncmp(optarg, LOCAL_PREFIX, strlen(LOCAL_PREFIX)) != 0 ||
+                    optarg[strlen(LOCAL_PREFIX)] == '\0') {
+                    usage();
+                    exit(1);
+                }
+                // Made absolute, since the server changes its directory.
+                server_options.local_socket = optarg + strlen(LOCAL_PREFIX);
+                if (server_options.local_socket[0] != '/') {
+                    char cwd[PATH_MAX];
+                    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+                        perror("getcwd");
+                        exit(1);
+                    }
+                    server_options.local_socket = generate_path(cwd, (char *)server_options.local_socket);
+                }
+                break;
+            case 'd':
+                if (strcmp(optarg, "none") == 0) {
+                    server_options.durability = DURABILITY_NONE;
+                } else if (strcmp(optarg, "per-file") == 0) {
+                    server_options.durability = DURABILITY_FILE;
+                } else if (strcmp(optarg, "group") == 0) {
+                    server_options.durability = DURABILITY_GROUP;
+                } else {
+                    usage();
+                    exit(1);
+                }
+                break;
+            case 't':
+            case 'b':
+            case 'T':
+            case 'B':
+                if ((value = parse_size(optarg)) == -1 || ((opt == 't' || opt == 'T') && value > INT_MAX)) {
+                    usage();
+                    exit(1);
+                }
+                if (opt == 't') {
+                    server_options.client_transfers = value;
+                } else if (opt == 'b') {
+                    server_options.client_in_flight = value;
+                } else if (opt == 'T') {
+                    server_options.max_transfers = value;
+                } else {
+                    server_options.max_in_flight = value;
+                }
+                break;
+            case 'W':
+                server_options.stream_window = parse_size(optarg);
+                if (server_options.stream_window < MIN_STREAM_WINDOW ||
+                    server_options.stream_window > MAX_STREAM_WINDOW) {
+                    usage();
+                    exit(1);
+                }
+                break;
+            default:
+                usage();
+                exit(1);
+        }
+    }
+    if(argc - optind != 1) {
+        usage();
         exit(1);
     }
     /* NOTE:  The directory PATH_PREFIX/sandbox/dest will be the directory in
@@ -28,7 +134,7 @@ int main(int argc, char **argv) {
 
     // create the sandbox directory
     char path[MAXPATH];
-    strncpy(path, argv[1], MAXPATH);
+    strncpy(path, argv[optind], MAXPATH);
     strncat(path, "/", MAXPATH - strlen(path) + 1);
     strncat(path, "sandbox", MAXPATH - strlen(path) + 1);
 
@@ -0,0 +1,370 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "ftree.h"
+#include "tree_index.h"
+
+#define INITIAL_ENTRIES 1024
+#define INITIAL_STRINGS (64 * 1024)
+
+/*
+ * This function returns the 64-bit FNV-1a hash of the first len bytes of
+ * path.
+ */
+static uint64_t path_hash(const char *path, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)path[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static void *xrealloc(void *ptr, size_t size) {
+    ptr = realloc(ptr, size);
+    if (ptr == NULL) {
+        perror("tree_index: realloc");
+        exit(1);
+    }
+    return ptr;
+}
+
+static const char *path_of(const struct tree_index *ti, uint32_t id) {
+    return ti->strings + ti->entries[id].path;
+}
+
+/*
+ * This function is called when entry id has changed. The digest of every
+ * directory above it covers it, so those digests are stale now. A stale
+ * digest's ancestors are always stale too, so we can stop at the first.
+ */
+static void invalidate_ancestors(struct tree_index *ti, uint32_t id) {
+    for (uint32_t p = ti->entries[id].parent; p != NO_ENTRY; p = ti->entries[p].parent) {
+        if (!(ti->entries[p].flags & HASH_VALID)) {
+            break;
+        }
+        ti->entries[p].flags &= ~HASH_VALID;
+    }
+}
+
+/*
+ * This function takes the first len bytes of path and its hash h as
+ * inputs, and returns the slot holding that path, or the empty slot where
+ * it would be inserted.
+ */
+static uint32_t probe(const struct tree_index *ti, const char *path, size_t len, uint64_t h) {
+    uint32_t mask = ti->slots_capacity - 1;
+    uint32_t i = (uint32_t)(h >> 32) & mask;
+    while (ti->slots[i].entry != NO_ENTRY) {
+        if (ti->slots[i].path_hash == (uint32_t)h) {
+            const char *other = path_of(ti, ti->slots[i].entry);
+            if (strncmp(other, path, len) == 0 && other[len] == '\0') {
+                return i;
+            }
+        }
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static void grow_slots(struct tree_index *ti) {
+    free(ti->slots);
+    ti->slots_capacity *= 2;
+    ti->slots = xrealloc(NULL, ti->slots_capacity * sizeof(struct tree_slot));
+    memset(ti->slots, 0xff, ti->slots_capacity * sizeof(struct tree_slot));
+    for (uint32_t id = 0; id < ti->num_entries; id++) {
+        const char *path = path_of(ti, id);
+        size_t len = strlen(path);
+        uint64_t h = path_hash(path, len);
+        uint32_t slot = probe(ti, path, len, h);
+        ti->slots[slot].entry = id;
+        ti->slots[slot].path_hash = (uint32_t)h;
+    }
+}
+
+/*
+ * This function returns the id of the entry for the first len bytes of
+ * path, creating it (as a path that doesn't exist) and its missing
+ * ancestors if necessary.
+ */
+static uint32_t find_or_insert(struct tree_index *ti, const char *path, size_t len) {
+    uint64_t h = path_hash(path, len);
+    uint32_t slot = probe(ti, path, len, h);
+    if (ti->slots[slot].entry != NO_ENTRY) {
+        return ti->slots[slot].entry;
+    }
+
+    // The root ("") is created by tree_index_init(), so there always is
+    // a parent to link to.
+    size_t parent_len = 0;
+    for (size_t i = len; i > 0; i--) {
+        if (path[i - 1] == '/') {
+            parent_len = i - 1;
+            break;
+        }
+    }
+    uint32_t parent = find_or_insert(ti, path, parent_len);
+
+    if (ti->num_entries == ti->entries_capacity) {
+        ti->entries_capacity *= 2;
+        ti->entries = xrealloc(ti->entries, ti->entries_capacity * sizeof(struct tree_entry));
+    }
+    if (ti->strings_used + len + 1 > ti->strings_capacity) {
+        while (ti->strings_used + len + 1 > ti->strings_capacity) {
+            if (ti->strings_capacity > UINT32_MAX / 2) {
+                fprintf(stderr, "tree_index: too many paths\n");
+                exit(1);
+            }
+            ti->strings_capacity *= 2;
+        }
+        ti->strings = xrealloc(ti->strings, ti->strings_capacity);
+    }
+
+    uint32_t id = ti->num_entries++;
+    struct tree_entry *e = &ti->entries[id];
+    memset(e, 0, sizeof(*e));
+    e->path = ti->strings_used;
+    memcpy(ti->strings + ti->strings_used, path, len);
+    ti->strings[ti->strings_used + len] = '\0';
+    ti->strings_used += len + 1;
+    e->parent = parent;
+    e->first_child = NO_ENTRY;
+    e->next_sibling = ti->entries[parent].first_child;
+    ti->entries[parent].first_child = id;
+
+    // Keep the load factor below 1/2 so that probe sequences stay short.
+    if ((uint64_t)ti->num_entries * 2 > ti->slots_capacity) {
+        grow_slots(ti);
+    } else {
+        slot = probe(ti, path, len, h);
+        ti->slots[slot].entry = id;
+        ti->slots[slot].path_hash = (uint32_t)h;
+    }
+    return id;
+}
+
+void tree_index_init(struct tree_index *ti) {
+    ti->entries_capacity = INITIAL_ENTRIES;
+    ti->entries = xrealloc(NULL, ti->entries_capacity * sizeof(struct tree_entry));
+    ti->slots_capacity = INITIAL_ENTRIES * 2;
+    ti->slots = xrealloc(NULL, ti->slots_capacity * sizeof(struct tree_slot));
+    memset(ti->slots, 0xff, ti->slots_capacity * sizeof(struct tree_slot));
+    ti->strings_capacity = INITIAL_STRINGS;
+    ti->strings = xrealloc(NULL, ti->strings_capacity);
+    ti->strings_used = 0;
+
+    // Entry 0 is the dest directory itself, with the empty path.
+    ti->num_entries = 1;
+    memset(&ti->entries[0], 0, sizeof(struct tree_entry));
+    ti->entries[0].mode = S_IFDIR | 0700;
+    ti->entries[0].parent = NO_ENTRY;
+    ti->entries[0].first_child = NO_ENTRY;
+    ti->entries[0].next_sibling = NO_ENTRY;
+    ti->strings[ti->strings_used++] = '\0';
+    uint32_t slot = probe(ti, "", 0, path_hash("", 0));
+    ti->slots[slot].entry = 0;
+    ti->slots[slot].path_hash = (uint32_t)path_hash("", 0);
+}
+
+/*
+ * This function returns the entry for path, or NULL if the path isn't
+ * known to exist on the server. The pointer is only valid until the next
+ * call to tree_index_update().
+ */
+struct tree_entry *tree_index_find(struct tree_index *ti, const char *path) {
+    size_t len = strlen(path);
+    uint32_t slot = probe(ti, path, len, path_hash(path, len));
+    if (ti->slots[slot].entry == NO_ENTRY) {
+        return NULL;
+    }
+    struct tree_entry *e = &ti->entries[ti->slots[slot].entry];
+    return e->mode == 0 ? NULL : e;
+}
+
+/*
+ * This function records the metadata st of path, which has just been
+ * created or changed on disk. The cached hash is dropped unless the mode,
+ * size and mtime show that the content is unchanged. Returns the entry,
+ * which is valid until the next call to tree_index_update().
+ */
+struct tree_entry *tree_index_update(struct tree_index *ti, const char *path, const struct stat *st) {
+    uint32_t id = find_or_insert(ti, path, strlen(path));
+    struct tree_entry *e = &ti->entries[id];
+    int64_t mtime = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    // The size and mtime of a directory change with its entries, which
+    // are tracked (and digested) on their own.
+    if (e->mode != st->st_mode ||
+        (S_ISREG(st->st_mode) && (e->size != st->st_size || e->mtime != mtime))) {
+        e->flags &= ~HASH_VALID;
+        invalidate_ancestors(ti, id);
+    }
+    e->mode = st->st_mode;
+    e->size = st->st_size;
+    e->mtime = mtime;
+    return e;
+}
+
+void tree_index_set_hash(struct tree_entry *e, const char *hash) {
+    memcpy(e->hash, hash, HASH_SIZE);
+    e->flags |= HASH_VALID;
+}
+
+/*
+ * This function records that the permission of entry e has been changed
+ * to the permission bits of mode.
+ */
+void tree_index_set_mode(struct tree_index *ti, struct tree_entry *e, mode_t mode) {
+    if ((e->mode & 0777) != (mode & 0777)) {
+        e->mode = (e->mode & ~0777) | (mode & 0777);
+        invalidate_ancestors(ti, e - ti->entries);
+    }
+}
+
+/*
+ * This function records that path no longer exists. The entry is kept
+ * (and so are the links to it), only marked as absent.
+ */
+void tree_index_remove(struct tree_index *ti, const char *path) {
+    size_t len = strlen(path);
+    uint32_t slot = probe(ti, path, len, path_hash(path, len));
+    if (ti->slots[slot].entry != NO_ENTRY) {
+        struct tree_entry *e = &ti->entries[ti->slots[slot].entry];
+        if (e->mode != 0) {
+            invalidate_ancestors(ti, ti->slots[slot].entry);
+        }
+        e->mode = 0;
+        e->flags = 0;
+    }
+}
+
+/*
+ * This function takes a directory entry dir as input, and stores its
+ * Merkle digest in dir->hash. Digests are cached until something below
+ * dir changes, and files whose hash is unknown are hashed on the way.
+ * Hidden entries, links and other special files are left out, since
+ * clients never send them. If it succeeds return 0, otherwise (e.g. a
+ * file can't be read) return -1.
+ */
+int tree_index_digest(struct tree_index *ti, struct tree_entry *dir) {
+    if (dir->flags & HASH_VALID) {
+        return 0;
+    }
+    int n = 0, capacity = 16;
+    struct merkle_child *children = malloc(capacity * sizeof(struct merkle_child));
+    if (children == NULL) {
+        perror("tree_index: malloc");
+        exit(1);
+    }
+
+    for (uint32_t id = dir->first_child; id != NO_ENTRY; id = ti->entries[id].next_sibling) {
+        struct tree_entry *child = &ti->entries[id];
+        const char *path = path_of(ti, id);
+        const char *name = strrchr(path, '/') == NULL ? path : strrchr(path, '/') + 1;
+        if (child->mode == 0 || name[0] == '.' ||
+            !(S_ISREG(child->mode) || S_ISDIR(child->mode))) {
+            continue;
+        }
+        if (S_ISREG(child->mode) && !(child->flags & HASH_VALID)) {
+            FILE *f = fopen(path, "rb");
+            if (f == NULL) {
+                free(children);
+                return -1;
+            }
+            char blank[BLOCKSIZE];
+            tree_index_set_hash(child, hash(blank, f));
+            fclose(f);
+        }
+        if (S_ISDIR(child->mode) && tree_index_digest(ti, child) == -1) {
+            free(children);
+            return -1;
+        }
+        if (n == capacity) {
+            capacity *= 2;
+            children = xrealloc(children, capacity * sizeof(struct merkle_child));
+        }
+        children[n].name = name;
+        children[n].mode = child->mode;
+        children[n].size = child->size;
+        children[n].hash = child->hash;
+        n++;
+    }
+
+    char digest[BLOCKSIZE];
+    merkle_digest(digest, children, n);
+    tree_index_set_hash(dir, digest);
+    free(children);
+    return 0;
+}
+
+/*
+ * This function takes a tree index ti, a content index ci and a directory
+ * dir as inputs, and brings the entries below dir up to date with the disk.
+ * Regular files are hashed unless their cached hash is still good, and
+ * their hashes are added to ci if it isn't NULL. Entries that are gone
+ * from disk are marked absent. Hidden entries are skipped, since clients
+ * never send them. Paths are named the way they are passed to dir, where
+ * "." stands for the root of the index. Returns the number of entries seen.
+ */
+long tree_index_scan(struct tree_index *ti, struct content_index *ci, const char *dir) {
+    int is_root = strcmp(dir, ".") == 0;
+    uint32_t dir_id = find_or_insert(ti, is_root ? "" : dir, is_root ? 0 : strlen(dir));
+    DIR *dirp = opendir(dir);
+    if (dirp == NULL) {
+        perror("tree_index: opendir");
+        return 0;
+    }
+    long seen = 0;
+    struct dirent *dp;
+    while ((dp = readdir(dirp)) != NULL) {
+        if (dp->d_name[0] == '.') {
+            continue;
+        }
+        char *child = is_root ? strdup(dp->d_name) : generate_path(dir, dp->d_name);
+        struct stat st;
+        if (lstat(child, &st) == -1) {
+            perror("tree_index: lstat");
+            free(child);
+            continue;
+        }
+        struct tree_entry *e = tree_index_update(ti, child, &st);
+        e->flags |= SEEN;
+        seen++;
+        if (S_ISDIR(st.st_mode)) {
+            seen += tree_index_scan(ti, ci, child);
+        } else if (S_ISREG(st.st_mode)) {
+            if (!(e->flags & HASH_VALID)) {
+                FILE *f = fopen(child, "rb");
+                if (f != NULL) {
+                    char blank[BLOCKSIZE];
+                    tree_index_set_hash(e, hash(blank, f));
+                    fclose(f);
+                }
+            }
+            if (ci != NULL && (e->flags & HASH_VALID)) {
+                content_index_add(ci, e->hash, st.st_size, child);
+            }
+        }
+        free(child);
+    }
+    closedir(dirp);
+
+    // Whatever we didn't come across has been removed.
+    for (uint32_t id = ti->entries[dir_id].first_child; id != NO_ENTRY; id = ti->entries[id].next_sibling) {
+        struct tree_entry *e = &ti->entries[id];
+        if (e->flags & SEEN) {
+            e->flags &= ~SEEN;
+        } else if (e->mode != 0) {
+            const char *path = path_of(ti, id);
+            const char *name = strrchr(path, '/') == NULL ? path : strrchr(path, '/') + 1;
+            if (name[0] != '.') {
+                invalidate_ancestors(ti, id);
+                e->mode = 0;
+                e->flags = 0;
+            }
+        }
+    }
+    return seen;
+}
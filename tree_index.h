@@ -0,0 +1,61 @@
+#ifndef _TREE_INDEX_H_
+#define _TREE_INDEX_H_
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include "hash.h"
+#include "content_index.h"
+
+#define NO_ENTRY UINT32_MAX
+
+// Entry flags
+#define HASH_VALID 1    // hash holds the content hash, or a directory's digest
+#define SEEN 2          // used by tree_index_scan() to find removed entries
+
+/*
+ * The tree index is the server's in-memory copy of the dest tree's
+ * metadata, so that most requests can be answered without a syscall.
+ *
+ * Entries live in one dense array and refer to each other by index: every
+ * entry knows its parent, and every directory the head of its list of
+ * children. Paths are stored once, NUL-terminated, in a string arena.
+ * Lookups by path go through an open addressing table of entry indices.
+ * An entry takes 72 bytes plus its path plus 8-16 bytes of table, so
+ * 10M entries fit in well under 2 GB.
+ */
+struct tree_entry {
+    char hash[HASH_SIZE];   // content hash (or Merkle digest of a directory)
+    int64_t size;
+    int64_t mtime;          // nanoseconds since the epoch
+    uint32_t mode;          // st_mode, or 0 if the path doesn't exist
+    uint32_t path;          // offset of the path in the string arena
+    uint32_t parent;
+    uint32_t first_child;
+    uint32_t next_sibling;
+    uint32_t flags;
+};
+
+struct tree_slot {
+    uint32_t entry;         // NO_ENTRY if the slot is empty
+    uint32_t path_hash;     // low bits of the path hash, to skip strcmp()
+};
+
+struct tree_index {
+    struct tree_entry *entries;
+    uint32_t num_entries, entries_capacity;
+    struct tree_slot *slots;
+    uint32_t slots_capacity; // always a power of 2
+    char *strings;
+    uint32_t strings_used, strings_capacity;
+};
+
+void tree_index_init(struct tree_index *ti);
+struct tree_entry *tree_index_find(struct tree_index *ti, const char *path);
+struct tree_entry *tree_index_update(struct tree_index *ti, const char *path, const struct stat *st);
+void tree_index_set_hash(struct tree_entry *e, const char *hash);
+void tree_index_set_mode(struct tree_index *ti, struct tree_entry *e, mode_t mode);
+void tree_index_remove(struct tree_index *ti, const char *path);
+int tree_index_digest(struct tree_index *ti, struct tree_entry *dir);
+long tree_index_scan(struct tree_index *ti, struct content_index *ci, const char *dir);
+
+#endif // _TREE_INDEX_H_
@@ -0,0 +1,415 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "ftree.h"
+
+// A path is synced once it has been quiet for DEBOUNCE_MS, or at the latest
+// MAX_DELAY_MS after its first change if it never goes quiet (e.g. a log).
+#define DEBOUNCE_MS 200
+#define MAX_DELAY_MS 2000
+
+// After a sync that couldn't reach a server, the changes wait RETRY_MIN_MS
+// before they are tried again, twice as long after every further failure,
+// but never longer than RETRY_MAX_MS.
+#define RETRY_MIN_MS 1000
+#define RETRY_MAX_MS 60000
+
+#define WATCH_MASK (IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_TO)
+
+/*
+ * A path that has changed but hasn't been sent to the server yet. Bursts of
+ * events for the same path are coalesced into one of these.
+ */
+struct pending_change {
+    char *path;
+    long first_ms;      // time of the first event since the last sync
+    long last_ms;       // time of the latest event
+    int recursive;      // a new directory: its whole subtree must be sent
+};
+
+static char **wd_paths = NULL; /* watch descriptor -> watched path */
+static int wd_capacity = 0;
+
+static struct pending_change *pending = NULL;
+static int num_pending = 0;
+static int pending_capacity = 0;
+
+// Open addressing table of indices into pending, keyed by path, so that
+// a burst of events doesn't scan the whole pending list for every event.
+static int *pending_slots = NULL; /* -1 if the slot is empty */
+static int slots_capacity = 0;    /* always a power of 2 */
+
+static long retry_ms = 0;   /* the current backoff, 0 while servers are reachable */
+static long retry_at = 0;   /* no changes are sent before this time */
+
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * This function takes an inotify file descriptor ifd and a path as inputs,
+ * and watches path and, if it is a directory, every directory below it.
+ * It returns the number of watches added.
+ */
+static int add_watches(int ifd, const char *path) {
+    int wd = inotify_add_watch(ifd, path, WATCH_MASK);
+    if (wd == -1) {
+        perror("client: inotify_add_watch");
+        if (errno == ENOSPC) {
+            fprintf(stderr, "Raise fs.inotify.max_user_watches to watch this tree.\n");
+        }
+        return 0;
+    }
+    if (wd >= wd_capacity) {
+        int new_capacity = wd_capacity == 0 ? 1024 : wd_capacity;
+        while (new_capacity <= wd) {
+            new_capacity *= 2;
+        }
+        wd_paths = realloc(wd_paths, new_capacity * sizeof(char *));
+        if (wd_paths == NULL) {
+            perror("client: realloc");
+            exit(1);
+        }
+        memset(wd_paths + wd_capacity, 0, (new_capacity - wd_capacity) * sizeof(char *));
+        wd_capacity = new_capacity;
+    }
+    free(wd_paths[wd]);
+    wd_paths[wd] = strdup(path);
+
+    int added = 1;
+    DIR *dirp = opendir(path);
+    if (dirp == NULL) {
+        // A regular file, or a directory we can't read anyway.
+        return added;
+    }
+    struct dirent *dp;
+    while ((dp = readdir(dirp)) != NULL) {
+        // Hidden entries are never sent, so don't watch them either.
+        if (dp->d_name[0] == '.') {
+            continue;
+        }
+        char *child = generate_path(path, dp->d_name);
+        struct stat stat_child;
+        if (lstat(child, &stat_child) == 0 && S_ISDIR(stat_child.st_mode)) {
+            added += add_watches(ifd, child);
+        }
+        free(child);
+    }
+    closedir(dirp);
+    return added;
+}
+
+/*
+ * This function returns the 64-bit FNV-1a hash of path.
+ */
+static uint64_t path_hash(const char *path) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const char *p = path; *p != '\0'; p++) {
+        h ^= (unsigned char)*p;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/*
+ * This function returns the slot of pending_slots holding the pending
+ * change to path, or the empty slot where it would be inserted.
+ */
+static int probe(const char *path) {
+    int i = (int)(path_hash(path) >> 32) & (slots_capacity - 1);
+    while (pending_slots[i] != -1) {
+        if (strcmp(pending[pending_slots[i]].path, path) == 0) {
+            return i;
+        }
+        i = (i + 1) & (slots_capacity - 1);
+    }
+    return i;
+}
+
+/*
+ * This function refills pending_slots from the pending list, with room
+ * for at least min_capacity / 2 changes. It is called when the table is
+ * full and after pending changes have been synced and removed.
+ */
+static void rebuild_slots(int min_capacity) {
+    if (min_capacity > slots_capacity) {
+        int new_capacity = slots_capacity == 0 ? 128 : slots_capacity;
+        while (new_capacity < min_capacity) {
+            new_capacity *= 2;
+        }
+        free(pending_slots);
+        pending_slots = malloc(new_capacity * sizeof(int));
+        if (pending_slots == NULL) {
+            perror("client: malloc");
+            exit(1);
+        }
+        slots_capacity = new_capacity;
+    }
+    memset(pending_slots, 0xff, slots_capacity * sizeof(int));
+    for (int i = 0; i < num_pending; i++) {
+        pending_slots[probe(pending[i].path)] = i;
+    }
+}
+
+/*
+ * This function records a change to path. path is taken over by the
+ * pending list, which frees it once the change has been synced.
+ */
+static void queue_change(char *path, int recursive, long now) {
+    // Keep the load factor below 1/2 so that probe sequences stay short.
+    if ((num_pending + 1) * 2 > slots_capacity) {
+        rebuild_slots((num_pending + 1) * 2);
+    }
+    int slot = probe(path);
+    if (pending_slots[slot] != -1) {
+        struct pending_change *change = &pending[pending_slots[slot]];
+        change->last_ms = now;
+        change->recursive |= recursive;
+        free(path);
+        return;
+    }
+    if (num_pending == pending_capacity) {
+        pending_capacity = pending_capacity == 0 ? 64 : pending_capacity * 2;
+        pending = realloc(pending, pending_capacity * sizeof(struct pending_change));
+        if (pending == NULL) {
+            perror("client: realloc");
+            exit(1);
+        }
+    }
+    pending[num_pending].path = path;
+    pending[num_pending].first_ms = now;
+    pending[num_pending].last_ms = now;
+    pending[num_pending].recursive = recursive;
+    pending_slots[slot] = num_pending;
+    num_pending++;
+}
+
+static int is_due(const struct pending_change *change, long now) {
+    if (now < retry_at) {
+        return 0;
+    }
+    return now - change->last_ms >= DEBOUNCE_MS || now - change->first_ms >= MAX_DELAY_MS;
+}
+
+static int compare_changes(const void *a, const void *b) {
+    return strcmp(((const struct pending_change *)a)->path,
+                  ((const struct pending_change *)b)->path);
+}
+
+/*
+ * This function sends every pending change that is due to the servers.
+ * Changes are sent in path order, so that a new directory always reaches
+ * the server before the files created inside it. If a server can't be
+ * reached, the change and the ones after it stay pending, and are tried
+ * again after a backoff.
+ */
+static void flush_changes(char **hosts, int num_hosts, unsigned short port, long now) {
+    // Move the due changes to the front, then sort them.
+    int num_due = 0;
+    for (int i = 0; i < num_pending; i++) {
+        if (is_due(&pending[i], now)) {
+            struct pending_change tmp = pending[num_due];
+            pending[num_due] = pending[i];
+            pending[i] = tmp;
+            num_due++;
+        }
+    }
+    if (num_due == 0) {
+        return;
+    }
+    qsort(pending, num_due, sizeof(struct pending_change), compare_changes);
+
+    int num_synced = 0, num_errors = 0;
+    int num_done = num_due;
+    const char *covered = NULL; /* last recursively synced directory */
+    for (int i = 0; i < num_due; i++) {
+        char *path = pending[i].path;
+        size_t len = covered == NULL ? 0 : strlen(covered);
+        if (covered != NULL && strncmp(path, covered, len) == 0 && path[len] == '/') {
+            // Already sent as part of its new parent directory.
+            continue;
+        }
+        struct stat stat_path;
+        if (lstat(path, &stat_path) == -1) {
+            // Deleted again before we got to it; the server never deletes.
+            continue;
+        }
+        // If only a directory's own attributes changed, it is sent without
+        // its entries, which produce events of their own.
+        int result = rcopy_client(path, hosts, num_hosts, port, pending[i].recursive);
+        if (result == SYNC_DISCONNECTED) {
+            num_done = i;
+            break;
+        }
+        if (result != 0) {
+            num_errors++;
+        }
+        num_synced++;
+        if (S_ISDIR(stat_path.st_mode) && pending[i].recursive) {
+            covered = path;
+        }
+    }
+    if (num_done < num_due) {
+        retry_ms = retry_ms == 0 ? RETRY_MIN_MS : retry_ms * 2;
+        if (retry_ms > RETRY_MAX_MS) {
+            retry_ms = RETRY_MAX_MS;
+        }
+        retry_at = now + retry_ms;
+        printf("Synced %d changed path(s), %d error(s), server unreachable, retrying in %ld s.\n",
+               num_synced, num_errors, retry_ms / 1000);
+    } else {
+        retry_ms = 0;
+        printf("Synced %d changed path(s), %d error(s).\n", num_synced, num_errors);
+    }
+    fflush(stdout);
+
+    for (int i = 0; i < num_done; i++) {
+        free(pending[i].path);
+    }
+    memmove(pending, pending + num_done, (num_pending - num_done) * sizeof(struct pending_change));
+    num_pending -= num_done;
+    // The remaining changes have moved, and their old slots are stale.
+    rebuild_slots(0);
+}
+
+/*
+ * This function returns how long to wait for further events before the
+ * next pending change is due, in milliseconds, or -1 if nothing is pending.
+ */
+static int next_timeout(long now) {
+    int timeout = -1;
+    for (int i = 0; i < num_pending; i++) {
+        long due = pending[i].last_ms + DEBOUNCE_MS;
+        if (pending[i].first_ms + MAX_DELAY_MS < due) {
+            due = pending[i].first_ms + MAX_DELAY_MS;
+        }
+        if (due < retry_at) {
+            due = retry_at;
+        }
+        int left = due <= now ? 0 : (int)(due - now);
+        if (timeout == -1 || left < timeout) {
+            timeout = left;
+        }
+    }
+    return timeout;
+}
+
+/*
+ * This function takes string of source path, an array of num_hosts hosts
+ * and a port as inputs. It synchronizes source once, like rcopy_client, and
+ * then keeps watching it for changes and sends only the changed files and
+ * directories over the same connections. A lost connection is made again
+ * (e.g. once a restarted server is back) before the next changes are sent.
+ * It only returns if watching fails.
+ */
+int rcopy_watch(char *source, char **hosts, int num_hosts, unsigned short port) {
+    char abs_src[PATH_MAX];
+    if (realpath(source, abs_src) == NULL) {
+        perror("client: realpath");
+        return 1;
+    }
+
+    // A server that goes away must not take the watcher with it.
+    signal(SIGPIPE, SIG_IGN);
+
+    int ifd = inotify_init1(IN_CLOEXEC);
+    if (ifd == -1) {
+        perror("client: inotify_init1");
+        return 1;
+    }
+    // Watch before the initial sync, so that nothing changed during the
+    // sync can be missed.
+    int num_watches = add_watches(ifd, abs_src);
+
+    int result = rcopy_client(abs_src, hosts, num_hosts, port, 1);
+    if (result == SYNC_DISCONNECTED) {
+        // Sync everything again once the servers are back.
+        printf("Errors encountered during copy, retrying in %d s\n", RETRY_MIN_MS / 1000);
+        retry_ms = RETRY_MIN_MS;
+        retry_at = now_ms() + retry_ms;
+        queue_change(strdup(abs_src), 1, now_ms());
+    } else if (result != 0) {
+        printf("Errors encountered during copy\n");
+    } else {
+        printf("Copy completed successfully\n");
+    }
+    printf("Watching %d director%s for changes...\n", num_watches, num_watches == 1 ? "y" : "ies");
+    fflush(stdout);
+
+    char buffer[64 * (sizeof(struct inotify_event) + NAME_MAX + 1)]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    while (1) {
+        struct pollfd pfd = { .fd = ifd, .events = POLLIN };
+        if (poll(&pfd, 1, next_timeout(now_ms())) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("client: poll");
+            return 1;
+        }
+
+        if (pfd.revents & POLLIN) {
+            ssize_t len = read(ifd, buffer, sizeof(buffer));
+            if (len == -1) {
+                perror("client: read");
+                return 1;
+            }
+            long now = now_ms();
+            for (char *p = buffer; p < buffer + len; ) {
+                struct inotify_event *event = (struct inotify_event *)p;
+                p += sizeof(struct inotify_event) + event->len;
+
+                if (event->mask & IN_Q_OVERFLOW) {
+                    // Events were lost: fall back to a full pass.
+                    fprintf(stderr, "inotify queue overflow, resyncing everything\n");
+                    queue_change(strdup(abs_src), 1, now);
+                    continue;
+                }
+                if (event->wd < 0 || event->wd >= wd_capacity || wd_paths[event->wd] == NULL) {
+                    continue;
+                }
+                if (event->mask & IN_IGNORED) {
+                    // The watched directory is gone.
+                    free(wd_paths[event->wd]);
+                    wd_paths[event->wd] = NULL;
+                    continue;
+                }
+                if (event->len == 0) {
+                    // An event on the watched path itself. That only
+                    // matters when SRC is a single file, or for SRC's
+                    // own attributes; other directories also get the
+                    // event from their parent's watch.
+                    if (!(event->mask & IN_ISDIR) || (event->mask & IN_ATTRIB)) {
+                        queue_change(strdup(wd_paths[event->wd]), 0, now);
+                    }
+                    continue;
+                }
+                if (event->name[0] == '.') {
+                    continue;
+                }
+                char *path = generate_path(wd_paths[event->wd], event->name);
+                if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+                    num_watches += add_watches(ifd, path);
+                    queue_change(path, 1, now);
+                } else {
+                    queue_change(path, 0, now);
+                }
+            }
+        }
+
+        flush_changes(hosts, num_hosts, port, now_ms());
+    }
+}
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <linux/errqueue.h>
+
+#include "zerocopy.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+#define SLOT_SIZE (FRAME_HEADER_SIZE + MAX_FRAME_DATA)
+
+/*
+ * This function takes a zerocopy struct zc and a connected TCP socket fd
+ * as inputs, enables MSG_ZEROCOPY on the socket and allocates the buffers.
+ * If it succeeds return 0, otherwise (e.g. the kernel is older than 4.14)
+ * return -1 with errno set, and the caller should send by copying.
+ */
+int zerocopy_init(struct zerocopy *zc, int fd) {
+    int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == -1) {
+        return -1;
+    }
+    memset(zc, 0, sizeof(*zc));
+    zc->fd = fd;
+    // Page aligned, so that each buffer pins as few pages as possible.
+    if (posix_memalign((void **)&zc->buffers, 4096, (size_t)ZEROCOPY_BUFFERS * SLOT_SIZE) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * This function takes a zerocopy struct zc as input, and returns where the
+ * payload of the next data frame must be put, or NULL if every buffer is
+ * still in flight (see zerocopy_reap()).
+ */
+char *zerocopy_buffer(struct zerocopy *zc) {
+    if (zc->in_flight == ZEROCOPY_BUFFERS) {
+        return NULL;
+    }
+    return zc->buffers + (size_t)zc->head * SLOT_SIZE + FRAME_HEADER_SIZE;
+}
+
+/*
+ * This function takes a zerocopy struct zc, a stream, a frame type and the
+ * length of the payload that was put in zerocopy_buffer() as inputs, and
+ * sends the frame with MSG_ZEROCOPY, adding flags (e.g. MSG_MORE). The
+ * buffer stays in flight until its completion is reaped.
+ * If it succeeds return 0, otherwise return -1 with errno set.
+ */
+int zerocopy_send_frame(struct zerocopy *zc, uint32_t stream, uint32_t type,
+                        uint32_t length, int flags) {
+    char *slot = zc->buffers + (size_t)zc->head * SLOT_SIZE;
+    uint32_t header[3] = {htonl(stream), htonl(type), htonl(length)};
+    memcpy(slot, header, FRAME_HEADER_SIZE);
+
+    size_t left = FRAME_HEADER_SIZE + length;
+    int sent_any = 0;
+    while (left > 0) {
+        ssize_t n = send(zc->fd, slot, left, flags | MSG_ZEROCOPY);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // ENOBUFS: too many pages pinned, send this one by copying.
+            if (errno == ENOBUFS) {
+                if ((n = send(zc->fd, slot, left, flags)) != -1) {
+                    slot += n;
+                    left -= n;
+                    continue;
+                }
+            }
+            if (!sent_any) {
+                return -1;
+            }
+            // Part of it is in flight, so the buffer must wait anyway.
+            break;
+        }
+        // Every zerocopy send that succeeds gets a number.
+        zc->next_seq++;
+        sent_any = 1;
+        slot += n;
+        left -= n;
+    }
+    if (sent_any) {
+        zc->last_seq[zc->head] = zc->next_seq - 1;
+        zc->done[zc->head] = 0;
+        zc->head = (zc->head + 1) % ZEROCOPY_BUFFERS;
+        zc->in_flight++;
+    }
+    return left == 0 ? 0 : -1;
+}
+
+/*
+ * This function takes a zerocopy struct zc as input, reads the completion
+ * notifications that are waiting on the socket's error queue, and frees
+ * the buffers the kernel is done with. It never blocks.
+ * It returns the number of buffers freed, or -1 if reading failed.
+ */
+int zerocopy_reap(struct zerocopy *zc) {
+    int freed = 0;
+    while (1) {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(zc->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err *err = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            // The sends numbered ee_info to ee_data (inclusive) are done.
+            uint32_t lo = err->ee_info, hi = err->ee_data;
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                zc->copied += hi - lo + 1;
+            }
+            zc->completed += hi - lo + 1;
+            for (int i = 0, slot = zc->tail; i < zc->in_flight; i++) {
+                if (zc->last_seq[slot] - lo <= hi - lo) {
+                    zc->done[slot] = 1;
+                }
+                slot = (slot + 1) % ZEROCOPY_BUFFERS;
+            }
+        }
+    }
+
+    // Buffers are reused in order, so only free from the oldest one on.
+    while (zc->in_flight > 0 && zc->done[zc->tail]) {
+        zc->tail = (zc->tail + 1) % ZEROCOPY_BUFFERS;
+        zc->in_flight--;
+        freed++;
+    }
+    return freed;
+}
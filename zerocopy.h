@@ -0,0 +1,36 @@
+#ifndef _ZEROCOPY_H_
+#define _ZEROCOPY_H_
+
+#include <stdint.h>
+#include "mux.h"
+
+#define ZEROCOPY_BUFFERS 64     // frames in flight, 2 MiB of data
+
+/*
+ * Buffers for sending data frames with MSG_ZEROCOPY. The kernel sends
+ * straight from these pages instead of copying them into the socket, so
+ * a buffer can only be reused once the kernel reports on the socket's
+ * error queue that it is done with it. Buffers are used as a ring, in the
+ * order they are sent, which is also the order TCP completes them.
+ *
+ * Every zerocopy send gets the next number of a per-socket counter, and a
+ * completion covers a range of those numbers.
+ */
+struct zerocopy {
+    int fd;
+    char *buffers;          // ZEROCOPY_BUFFERS slots of header + data
+    uint32_t last_seq[ZEROCOPY_BUFFERS]; // the last send that used the slot
+    int done[ZEROCOPY_BUFFERS];
+    int head, tail, in_flight;
+    uint32_t next_seq;      // the number of the next zerocopy send
+    long copied;            // completions where the kernel copied after all
+    long completed;
+};
+
+int zerocopy_init(struct zerocopy *zc, int fd);
+char *zerocopy_buffer(struct zerocopy *zc);
+int zerocopy_send_frame(struct zerocopy *zc, uint32_t stream, uint32_t type,
+                        uint32_t length, int flags);
+int zerocopy_reap(struct zerocopy *zc);
+
+#endif // _ZEROCOPY_H_